@@ -0,0 +1,129 @@
+#pragma once
+
+#include <types.h>
+#include <util.h>
+
+// Root System Description Pointer
+struct acpi_rsdp
+{
+    char signature[8];
+    u8   checksum;
+    char oem_id[6];
+    u8   revision;
+    u32  rsdt_addr;
+
+    // Only valid if revision >= 2
+    u32  length;
+    u64  xsdt_addr;
+    u8   ext_checksum;
+    u8   reserved[3];
+} __attribute__((packed));
+
+// Header every system description table starts with
+struct acpi_sdt_hdr
+{
+    char signature[4];
+    u32  length;
+    u8   revision;
+    u8   checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32  oem_revision;
+    u32  creator_id;
+    u32  creator_revision;
+} __attribute__((packed));
+
+/* MCFG (PCIe memory mapped configuration space) */
+
+struct acpi_mcfg_entry
+{
+    u64 base_addr;  // ECAM base address
+    u16 segment;    // PCI segment group
+    u8  start_bus;
+    u8  end_bus;
+    u32 reserved;
+} __attribute__((packed));
+
+struct acpi_mcfg
+{
+    struct acpi_sdt_hdr hdr;
+    u64 reserved;
+    struct acpi_mcfg_entry entries[];
+} __attribute__((packed));
+
+/* SRAT (System Resource Affinity Table) */
+
+#define ACPI_SRAT_CPU       0   // Processor local APIC affinity
+#define ACPI_SRAT_MEMORY    1   // Memory affinity
+#define ACPI_SRAT_X2APIC    2   // Processor local x2APIC affinity
+
+#define ACPI_SRAT_ENABLED   (1 << 0)
+
+struct acpi_srat
+{
+    struct acpi_sdt_hdr hdr;
+    u32 reserved0;
+    u64 reserved1;
+    u8  entries[];  // Variable length affinity structures
+} __attribute__((packed));
+
+struct acpi_srat_entry
+{
+    u8 type;
+    u8 length;
+} __attribute__((packed));
+
+struct acpi_srat_cpu
+{
+    u8  type;
+    u8  length;
+    u8  domain_lo;      // Proximity domain bits 0-7
+    u8  apic_id;
+    u32 flags;
+    u8  sapic_eid;
+    u8  domain_hi[3];   // Proximity domain bits 8-31
+    u32 clock_domain;
+} __attribute__((packed));
+
+struct acpi_srat_memory
+{
+    u8  type;
+    u8  length;
+    u32 domain;
+    u16 reserved0;
+    u64 base_addr;
+    u64 length_bytes;
+    u32 reserved1;
+    u32 flags;
+    u64 reserved2;
+} __attribute__((packed));
+
+struct acpi_srat_x2apic
+{
+    u8  type;
+    u8  length;
+    u16 reserved0;
+    u32 domain;
+    u32 x2apic_id;
+    u32 flags;
+    u32 clock_domain;
+    u32 reserved1;
+} __attribute__((packed));
+
+/* SLIT (System Locality Information Table) */
+
+struct acpi_slit
+{
+    struct acpi_sdt_hdr hdr;
+    u64 num_localities;
+    u8  distances[];    // num_localities x num_localities matrix
+} __attribute__((packed));
+
+// Search for root system description pointer
+struct acpi_rsdp* acpi_search_rsdp();
+
+// Find table by signature (e.g. "MCFG"), returns NULL if not present
+struct acpi_sdt_hdr* acpi_find_table(char *signature);
+
+// Number of entries in MCFG table
+i64 acpi_mcfg_num_entries(struct acpi_mcfg *mcfg);
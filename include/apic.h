@@ -168,6 +168,12 @@ lapic_t lapic_init(u8 spurious_interrupt_vector,
 lapic_t lapic_fetch();
 u8      lapic_id();
 
+// Upper bound for per cpu data (indexed by cpu_id)
+#define MAX_CPUS 16
+
+// Initial APIC id of the executing cpu (CPUID, works without LAPIC mapping)
+u8 cpu_id();
+
 bool   lapic_enabled();
 void   lapic_end_of_int();
 
@@ -202,6 +208,9 @@ void lapic_timer_deinit(lapic_t lapic);
 // Boot an AP
 bool lapic_boot_ap(lapic_t lapic, u8 lapic_dst_id);
 
+// Send interrupt vector to one cpu
+void lapic_ipi_fixed(lapic_t lapic, u8 lapic_dst_id, u8 vector);
+
 //--------//
 // IOAPIC //
 //--------//
@@ -226,7 +235,7 @@ void ioapic_mask(ioapic_t apic, u8 index, u32 mask);
 
 // Generic SMP stuff
 
-#define SMP_STACK_SIZE 16364
+#define SMP_STACK_SIZE 16384
 
 struct smp_boot_params
 {
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vmm.h>
+#include <apic.h>
+#include <sync.h>
+#include <util.h>
+#include <types.h>
+
+/* Address spaces
+
+   An address space is a PML4 plus the PCID (process context identifier)
+   its TLB entries are tagged with. With PCIDs, switching between address
+   spaces keeps the TLB entries of all of them. PCID 0 belongs to the
+   kernel address space. If the cpu lacks PCIDs or all of them are taken,
+   switches flush the TLB as before.
+
+   The kernel lives in PML4 slot 0 (identity mapping) and the upper half,
+   which every address space shares. User mappings go in between. */
+
+#define ASPACE_NUM_PCIDS    4096
+#define ASPACE_NO_PCID      0xFFFF      // Flush on every switch
+
+#define ASPACE_USER_START   0x8000000000        // PML4 slot 1
+#define ASPACE_USER_END     0x800000000000      // End of lower half
+
+#define CR3_NO_FLUSH        (1ULL << 63)
+#define CR4_PCIDE           (1 << 17)
+
+struct aspace
+{
+    struct page_table *root;
+    u16 pcid;
+    u64 tlb_cpus;       // Cpus which flushed stale entries of the PCID (bit per cpu id)
+    u64 active_cpus;    // Cpus which have it loaded
+    mutex_t lock;       // Protects the user part of the tables and the regions
+    struct ktree regions;
+};
+
+// Enables PCIDs on the executing cpu if supported, every cpu must call it once
+void aspace_cpu_init();
+
+// Returns NULL if out of memory
+struct aspace* aspace_create();
+// Must not be active on any cpu, frames of its regions are freed
+void aspace_destroy(struct aspace *as);
+
+// Copy on write duplicate of the user part, NULL if out of memory
+struct aspace* aspace_fork(struct aspace *parent);
+
+void aspace_switch(struct aspace *as);
+
+struct aspace* aspace_kernel();
+struct aspace* aspace_current();
+
+bool aspace_pcid_enabled();
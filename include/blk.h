@@ -0,0 +1,62 @@
+#pragma once
+
+#include <pmm.h>
+#include <util.h>
+#include <types.h>
+#include <virtio_blk.h>
+
+/*
+ * Block layer request queue
+ *
+ * Writes are copied into the queue and held back until the queue is
+ * dispatched. On dispatch pending writes are sorted by LBA and adjacent
+ * ones are merged into scatter gather requests (bounded by the device's
+ * seg_max/size_max). Reads are served from pending writes if possible.
+ * Writes that don't cover whole physical blocks are turned into aligned
+ * ones by a read-modify-write in the guest.
+ */
+
+#define BLK_SECTOR_SIZE VIRTIO_BLK_SECTOR_SIZE
+
+// Max number of pending writes
+#define BLK_QUEUE_DEPTH 64
+
+// Dispatch when the oldest pending write has seen this many newer writes
+#define BLK_DEADLINE 32
+
+// Upper bound for a merged request (in sectors)
+#define BLK_MAX_REQ_SECTORS 256
+
+// Pending write
+struct blk_req
+{
+    u64 sector;
+    u64 num_sectors;
+    u64 seq;    // Arrival number (used for deadline)
+    u8 *data;   // Private copy of data
+};
+
+struct blk_queue
+{
+    virtio_blk_dev_t *dev;
+    struct blk_req *reqs;   // Pending writes in arrival order
+    i64 num_reqs;
+    u64 seq;                // Arrival counter
+    u64 seg_sectors;        // Max sectors per segment
+    u64 max_sectors;        // Max sectors per device request
+    u64 lblk_sectors;       // Logical block size (in sectors)
+    u64 align_sectors;      // Writes should be aligned to and multiples of this (in sectors)
+    u64 align_phase;        // Sector offset of aligned writes
+};
+
+bool blk_queue_init(struct blk_queue *queue, virtio_blk_dev_t *dev);
+void blk_queue_deinit(struct blk_queue *queue);
+
+bool blk_read(struct blk_queue *queue, u64 sector, u8 *data, u64 num_sectors);
+bool blk_write(struct blk_queue *queue, u64 sector, u8 *data, u64 num_sectors);
+bool blk_write_zeroes(struct blk_queue *queue, u64 sector, u64 num_sectors, bool unmap);
+
+// Submit all pending writes to the device
+bool blk_dispatch(struct blk_queue *queue);
+// Dispatch and make everything durable
+bool blk_flush(struct blk_queue *queue);
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <pmm.h>
+#include <numa.h>
+#include <sync.h>
+#include <util.h>
+#include <types.h>
+
+/* Physical frame allocator
+
+   Buddy allocator for page frames which keeps all meta information in an
+   array of struct page indexed by frame number (PFN). Free blocks are linked
+   through the array by PFN, so finding and merging a buddy is O(1) and the
+   frames themselves are never touched. There is one zone per NUMA node. */
+
+#define FRAME_SIZE PAGE_SIZE
+
+// Blocks of 2^0 up to 2^18 frames (1 GiB)
+#define FRAME_MAX_ORDER 19
+
+// Huge page sizes
+#define FRAME_ORDER_2M  9
+#define FRAME_ORDER_1G  18
+#define FRAME_SIZE_2M   (FRAME_SIZE << FRAME_ORDER_2M)
+#define FRAME_SIZE_1G   (FRAME_SIZE << FRAME_ORDER_1G)
+
+// Reserved 1 GiB blocks per zone at most
+#define FRAME_HUGE_POOL 64
+
+// End of free list
+#define FRAME_NONE 0xFFFFFFFF
+
+// Frame flags
+#define FRAME_FREE      (1 << 0)    // First frame of a free block
+#define FRAME_ALLOC     (1 << 1)    // First frame of an allocated block
+#define FRAME_RESERVED  (1 << 2)    // Never handed to the allocator (not ram, kernel, ...)
+#define FRAME_POOLED    (1 << 3)    // 1 GiB block owned by the huge page reserve
+
+// Meta information for one frame
+struct page
+{
+    u32 next;       // Free list links (PFNs)
+    u32 prev;
+    u8  order;      // Order of the block this frame heads
+    u8  flags;
+    u16 refcount;
+    u8  node;       // Zone this frame belongs to
+    u8  reserved[3];
+} __attribute__((packed));
+
+/* Zero pools
+
+   Every zone keeps a few blocks of the smallest orders zeroed in advance,
+   so page tables and device queues don't have to be cleared when they are
+   allocated. Pools are filled from the idle loop and given back to the
+   zone when it runs out of memory. */
+
+#define FRAME_ZERO_ORDERS   3   // Pools for blocks of 1, 2 and 4 frames
+#define FRAME_ZERO_POOL     16  // Blocks per pool
+#define FRAME_ZERO_MIN_FREE 1024    // Pools aren't filled from zones with less free frames
+
+struct frame_zone
+{
+    u64 start_pfn;                          // Lowest frame of this zone
+    u64 end_pfn;                            // Exclusive
+    u32 free_lists[FRAME_MAX_ORDER];        // Heads of free lists
+    u64 free_blocks[FRAME_MAX_ORDER];       // Length of free lists
+    u64 free_frames;
+    u64 min_free;                           // Low-water mark of free_frames
+    u64 allocs;
+    u64 frees;
+    u32 zero_pool[FRAME_ZERO_ORDERS][FRAME_ZERO_POOL];  // PFNs of zeroed blocks
+    u64 zero_count[FRAME_ZERO_ORDERS];
+    u32 huge_pool[FRAME_HUGE_POOL];     // PFNs of unused reserved 1 GiB blocks
+    u64 huge_count;
+    u64 huge_reserved;                  // Reserved 1 GiB blocks in use or pooled
+    mutex_t lock;
+};
+
+// Meta information of all frames
+extern struct page *frame_map;
+extern u64 frame_map_len;
+
+// Frame number <-> address
+#define FRAME_PFN(addr) ((u64)(addr) / FRAME_SIZE)
+#define FRAME_ADDR(pfn) ((u64)(pfn) * FRAME_SIZE)
+
+// Space needed for meta information of num_frames frames
+u64 frame_map_size(u64 num_frames);
+
+// Frames are reserved until added with frame_add_range
+void frame_init(struct page *map, u64 num_frames);
+
+// Hand range of physical memory to the allocator (unaligned parts are ignored)
+void frame_add_range(u64 start, u64 end);
+
+// Allocates 2^order contiguous frames aligned to their size, returns -1 if out of memory
+// Prefers the executing cpu's node and falls back to others by distance
+i64  frame_alloc(u64 order);
+// Same but only from the given node
+i64  frame_alloc_node(u8 node, u64 order);
+// Frees a block returned by frame_alloc
+bool frame_free(u64 addr);
+
+// Shared frames (refcount in struct page), frame_put frees on the last reference and returns true then
+void frame_get(u64 addr);
+bool frame_put(u64 addr);
+
+/* Huge pages
+
+   2 MiB and 1 GiB blocks are naturally aligned like every block, so they
+   can back huge page mappings directly. 1 GiB blocks are hard to come by
+   once memory is fragmented, so some can be set aside at boot. Reserved
+   blocks return to their reserve when freed. */
+
+// Returns -1 if there is no free block
+i64  frame_alloc_2m();
+// Prefers reserved blocks, then free memory of the nearest node
+i64  frame_alloc_1g();
+// Moves up to count 1 GiB blocks of a node into its reserve, returns number reserved
+u64  frame_reserve_1g(u8 node, u64 count);
+
+// Like frame_alloc but the block is zeroed, served from the zero pools if possible
+i64  frame_zalloc(u64 order);
+// Zeroes one block for the pools, returns false if there was nothing to do
+bool frame_zero_refill();
+
+struct page* frame_page(u64 addr);
+
+// Number of frames currently available (all nodes or one node)
+u64 frame_free_count();
+u64 frame_node_free_count(u8 node);
+
+// Print free blocks per order and counters of a node
+void frame_dump_stats(u8 node);
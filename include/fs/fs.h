@@ -1,5 +1,7 @@
 #pragma once
 
+#include <blk.h>
+#include <sync.h>
 #include <util.h>
 #include <types.h>
 #include <virtio_blk.h>
@@ -73,10 +75,17 @@ struct dir_entry
     char file_name[FS_NAME_LEN];
 } __attribute__((packed));
 
+/* The fs_* calls below are serialized by lock, which guards the queue,
+   the device and tmp. It is taken with interrupts left as they are, so a
+   page fault can read a file with interrupts (and shootdowns) enabled.
+   Interrupt handlers must not call into the fs. */
 struct fs
 {
     virtio_blk_dev_t *blk_dev;      // Virtio block device
+    struct blk_queue queue;         // Request queue in front of blk_dev
     struct superblock sb_cache;     // Cached superblock
+    mutex_t lock;
+    u8 tmp[FS_BLOCK_SIZE];          // Block cache to save stack space
 };
 
 // Init superblock and initialize root dir
@@ -92,6 +101,14 @@ i64 fs_handle(struct fs *fs, char *path);
 bool fs_size(struct fs *fs, i64 handle, i64 *size);
 
 bool fs_seek(struct fs *fs, i64 handle, i64 off);
+
+// Make all previous modifications durable
+bool fs_sync(struct fs *fs);
 bool fs_wrfl(struct fs *fs, i64 handle, u8 *data, i64 len);
 bool fs_refl(struct fs *fs, i64 handle, u8 *data, i64 len);
 
+// Reads the block of a file at off (block aligned) straight into page, zeroed behind the end of the file
+bool fs_read_page(struct fs *fs, i64 handle, i64 off, u8 *page);
+// Writes page to the block of a file at off, the file isn't resized (blocks behind the end are skipped)
+bool fs_write_page(struct fs *fs, i64 handle, i64 off, u8 *page);
+
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <util.h>
+#include <types.h>
+#include <fs/fs.h>
+
+/* Page cache of mapped files
+
+   Every block of a file which is mapped somewhere is held in exactly one
+   frame, shared by all mappings of it. The block is read straight into
+   the frame on the first get and written back from it when the last
+   mapping puts it dirty, so mapped file data is never copied through the
+   fs scratch buffer. Writes go through the block queue like all others.
+
+   fs_refl and fs_wrfl don't look into the cache, dirty pages reach the
+   file with pcache_flush or when the last mapping is gone.
+
+   Reads and writes run without the cache lock and with interrupts as
+   the caller had them. The first get inserts the page as loading and
+   later gets of the block spin until it is read. A dirty page whose
+   last reference is gone stays in the cache with no users until it is
+   written back, gets spin until it is removed. */
+
+struct pcache_page
+{
+    struct fs *fs;
+    i64 handle;
+    i64 off;            // Block aligned file offset
+
+    u64 frame;
+    u64 users;          // References taken by pcache_get
+    bool dirty;
+    bool loading;       // Being read by the first get, frame is -1 if that failed
+
+    struct ktree_node tree_handle;
+};
+
+bool pcache_init();
+
+// Frame holding the block at off with a reference taken, -1 if out of memory or on io errors
+i64  pcache_get(struct fs *fs, i64 handle, i64 off);
+// Drops a reference, dirty marks the frame as modified. The last one writes back and frees the frame.
+void pcache_put(struct fs *fs, i64 handle, i64 off, bool dirty);
+// Writes the frame back now, caller holds a reference
+bool pcache_flush(struct fs *fs, i64 handle, i64 off);
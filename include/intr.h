@@ -38,7 +38,14 @@ void idt_register_handler(struct interrupt_descriptor_table *idt, u64 id, u64 ha
 void intr_enable();
 void intr_disable();
 
+// Disable interrupts and return previous rflags
+u64  intr_save();
+// Reenable interrupts if they were enabled before intr_save
+void intr_restore(u64 flags);
+
 void intr_setup();
+// Load the IDT built by intr_setup on an AP
+void intr_ap_setup();
 
 struct cpu_context
 {
@@ -86,5 +93,8 @@ void pic_disable();
 
 // Interrupt number assignments 
 #define INTR_NUM_PIT 0xFF
+#define INTR_NUM_TLB 0xF0
+#define INTR_NUM_PF  0x0E
 
-struct cpu_context* intr_handler(struct cpu_context* saved_context, u64 code);
+// Error is the exception's error code, 0 for all other interrupts
+struct cpu_context* intr_handler(struct cpu_context* saved_context, u64 code, u64 error);
@@ -13,6 +13,16 @@ u32 ind(u32 port);
 u64 rmsr(u32 msr);
 void wmsr(u32 msr, u64 val);
 
+// Control registers
+u64 rcr0();
+void wcr0(u64 val);
+u64 rcr2();
+u64 rcr4();
+void wcr4(u64 val);
+
+// regs = {eax, ebx, ecx, edx}
+void cpuid(u32 leaf, u32 subleaf, u32 *regs);
+
 void mmio_writeb(size_t addr, u8  val);
 void mmio_writew(size_t addr, u16 val);
 void mmio_writed(size_t addr, u32 val);
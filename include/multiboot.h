@@ -17,6 +17,9 @@ struct multiboot_memory_map
     u32 entry_version;
 } __attribute__((packed));
 
+// Memory map entry types
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
 struct multiboot_memory_map_entry
 {
     u64 address;
@@ -25,6 +28,9 @@ struct multiboot_memory_map_entry
     u32 reserved;
 } __attribute__((packed));
 
+// Size of the whole multiboot information (all tags)
+u64 multiboot_info_size(struct multiboot_information* mb_info);
+
 struct multiboot_memory_map* multiboot_memmap(struct multiboot_information* mb_info);
 int multiboot_memmap_num_entries(struct multiboot_memory_map* memmap);
 struct multiboot_memory_map_entry* multiboot_memmap_entry(struct multiboot_memory_map *memmap, u64 index);
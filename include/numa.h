@@ -0,0 +1,41 @@
+#pragma once
+
+#include <acpi.h>
+#include <apic.h>
+#include <types.h>
+
+/* NUMA topology from ACPI SRAT/SLIT
+
+   Proximity domains are renumbered to nodes 0..n-1. Without SRAT there
+   is a single node owning all cpus and memory. */
+
+#define NUMA_MAX_NODES  8
+#define NUMA_MAX_RANGES 16
+
+// Distance of a node to itself (SLIT convention)
+#define NUMA_LOCAL_DISTANCE 10
+
+// Memory range with affinity to one node
+struct numa_range
+{
+    u64 start;
+    u64 end;
+    u8  node;
+};
+
+// Parse ACPI tables, must run before the frame allocator is set up
+void numa_init();
+
+u64 numa_num_nodes();
+
+// Node of a cpu (by APIC id) and of the executing cpu
+u8 numa_cpu_node(u8 apic_id);
+u8 numa_local_node();
+
+// Node of a physical address, end receives the end of the range with this node
+u8 numa_memory_node(u64 addr, u64 *end);
+
+u8 numa_distance(u8 from, u8 to);
+
+// Nodes ordered by distance from node (node itself comes first)
+u8* numa_fallback(u8 node);
@@ -15,13 +15,17 @@ typedef struct
     u8 fun;
 } pci_dev_t;
 
-u32 pci_read_dword(pci_dev_t *pci_dev, u8 reg);
-u16 pci_read_word(pci_dev_t *pci_dev, u8 reg);
-u8 pci_read_byte(pci_dev_t *pci_dev, u8 reg);
+// Use memory mapped config space (PCIe ECAM) if firmware provides it
+bool pci_ecam_init();
+bool pci_ecam_available();
 
-void pci_write_dword(pci_dev_t *pci_dev, u8 reg, u32 val);
-void pci_write_word(pci_dev_t *pci_dev, u8 reg, u16 val);
-void pci_write_byte(pci_dev_t *pci_dev, u8 reg, u8 val);
+u32 pci_read_dword(pci_dev_t *pci_dev, u16 reg);
+u16 pci_read_word(pci_dev_t *pci_dev, u16 reg);
+u8 pci_read_byte(pci_dev_t *pci_dev, u16 reg);
+
+void pci_write_dword(pci_dev_t *pci_dev, u16 reg, u32 val);
+void pci_write_word(pci_dev_t *pci_dev, u16 reg, u16 val);
+void pci_write_byte(pci_dev_t *pci_dev, u16 reg, u8 val);
 
 bool pci_ready(pci_dev_t *pci_dev);
 u16 pci_vendor_id(pci_dev_t *pci_dev);
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <pmm.h>
+#include <apic.h>
+#include <types.h>
+#include <syscalls.h>
+#include <user_mode.h>
+
+/* Per cpu data
+
+   Every cpu has a struct percpu and GS_BASE points to it while the cpu
+   runs kernel code. this_cpu is a single gs relative load, unlike cpu_id
+   which executes CPUID, and only the owning cpu (and its interrupt
+   handlers) touches the data, so no locks are needed.
+
+   In user mode the bases are swapped: KERNEL_GS_BASE holds the struct
+   and syscall_handler and the interrupt stubs swapgs on entry from ring
+   3. The kernel_root comes first, syscall_handler uses its offsets.
+
+   Every cpu also gets its own GDT with its own TSS, a TSS descriptor is
+   marked busy by ltr and can't be loaded by two cpus. */
+
+#define MSR_IA32_GS_BASE 0xC0000101
+
+#define PERCPU_GDT_ENTRIES 7    // Null, kernel code/data, user data/code, TSS (2 entries)
+
+struct aspace;
+
+struct percpu
+{
+    struct kernel_root root;    // Syscall stack and scratch, must be first
+
+    struct percpu *self;        // Read by this_cpu
+    u8 id;                      // Initial APIC id, index of per cpu arrays
+
+    struct aspace *aspace;      // Active address space
+
+    struct kmag_cpu kmag;       // kmalloc magazines and counters
+
+    struct task_state_segment tss;
+    u64 gdt[PERCPU_GDT_ENTRIES];
+} __attribute__((aligned(64)));
+
+// Sets up the executing cpu's data with stack as kernel stack for syscalls and interrupts from user mode.
+// Returns false if the cpu's id is out of range.
+bool percpu_init(u64 stack);
+
+// Data of the cpu with id, NULL if it was never initialized
+struct percpu* percpu_cpu(u8 id);
+
+static inline struct percpu* this_cpu()
+{
+    // Constant on a cpu, so the compiler may merge loads
+    struct percpu *cpu;
+    __asm__("mov %%gs:%c1, %0" : "=r" (cpu) : "i" (__builtin_offsetof(struct percpu, self)));
+    return cpu;
+}
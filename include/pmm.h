@@ -1,7 +1,9 @@
 #pragma once
 
-#include <types.h>
+#include <sync.h>
 #include <util.h>
+#include <types.h>
+#include <multiboot.h>
 
 #define PAGE_SIZE (u64)(1 << 12)
 #define PAGE_MASK (u64)(PAGE_SIZE - 1)   // To check for correct alignment
@@ -12,26 +14,106 @@ u64 align(u64 addr, u64 alignment);
 /* We will use a modified version of the buddy allocator 
    combined with trees to make memory allocation as fast as possible */
 
+/* Heap statistics, updated under the heap lock */
+struct kheap_stats
+{
+   u64 allocs;       // Successful allocations
+   u64 frees;
+   u64 failed;       // Allocations without memory left
+   u64 used_pages;   // Pages in allocated chunks (chunks in magazines count as allocated)
+   u64 peak_pages;   // High-water mark of used_pages
+   u64 heap_pages;   // Pages taken from the frame allocator
+};
+
 /* Allocator management structure */
 struct kheap
 {
-   struct ktree used_buddies;     // Sortex by addr
-   struct ktree free_buddies[48]; // Sorted by size
+   struct ktree used_buddies;     // Sorted by addr
+   struct ktree free_buddies[48]; // One tree per chunk size (2^index pages), sorted by addr
+   mutex_t lock;
+   u8 node;                       // NUMA node the heap takes frames from
+   struct kheap_stats stats;
 };
 
+/* Chunk states, magic values so that stray pointers rarely pass as chunks */
+#define KCHUNK_FREE 0x6672656563686e6bULL  // In the heap, a magazine or owned by a kheap_alloc caller
+#define KCHUNK_USED 0x7573656463686e6bULL  // Handed out by kmalloc
+
 /* Structure sitting at top of each chunk */
 struct kchunk
 {
    i64 addr;
    i64 size; // In number of pages
+   u64 state;
    struct ktree_node tree_handle;
-} __attribute__((packed));
+#ifdef KMALLOC_TRACE
+   u64 site;      // Caller of kmalloc
+   u64 req_size;  // Requested bytes
+#endif
+};
 
 /* Note: It is assumed that the effective part of an addresses is < 64bit */
 
-void kheap_init(struct kheap *heap);
+// Order of blocks (2^n pages) the heap takes from the frame allocator when it runs dry
+#define KHEAP_GROW_ORDER 9
+
+void kheap_init(struct kheap *heap, u8 node);
 i64 kheap_alloc(struct kheap *heap, i64 size);
 i64 kheap_free(struct kheap *heap, i64 addr);
 
+/* Per cpu magazines
+
+   kmalloc/kfree keep small chunks (allocated but unused kheap chunks)
+   in per cpu stacks, so most calls don't touch the heap trees or its lock.
+   Magazines are refilled and drained in batches. */
+
+#define KMAG_ORDERS 4   // Cache chunks of 1, 2, 4 and 8 pages
+#define KMAG_SIZE   16  // Chunks per magazine
+#define KMAG_BATCH  8   // Chunks moved between magazine and heap at once
+
+struct kmagazine
+{
+   i64 count;
+   i64 chunks[KMAG_SIZE]; // As returned by kheap_alloc
+};
+
+struct kmag_cpu
+{
+   struct kmagazine mags[KMAG_ORDERS];
+   u64 allocs;    // kmalloc calls on this cpu
+   u64 frees;     // kfree calls on this cpu
+   u64 hits;      // Calls served by the magazines
+};
+
 i64 kmalloc(i64 size);
-i64 kfree(i64 addr);
\ No newline at end of file
+i64 kfree(i64 addr);
+
+/* Allocation tracking per call site (build with KMALLOC_TRACE=1) */
+
+#ifdef KMALLOC_TRACE
+
+#define KMALLOC_TRACE_SITES 128
+
+struct kmalloc_site
+{
+   u64 site;        // Return address of kmalloc call
+   u64 allocs;
+   u64 frees;
+   i64 live_bytes;  // Requested bytes not yet freed
+};
+
+#endif
+
+// Print heap, frame allocator and (if enabled) call site statistics
+void pmm_dump_stats();
+
+/* kmalloc prefers the executing cpu's NUMA node and falls back to other
+   nodes ordered by distance */
+
+// Share of each node's memory reserved as 1 GiB frames (1/2^n, rounded down)
+#define PMM_HUGE_RESERVE_SHIFT 3
+
+/* Hands all ram from the multiboot memory map to the frame allocator,
+   except for the kernel image, identity page tables, multiboot info and
+   low memory used by firmware and the AP trampoline. */
+bool pmm_init(struct multiboot_information *mb_info);
\ No newline at end of file
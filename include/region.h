@@ -0,0 +1,79 @@
+#pragma once
+
+#include <util.h>
+#include <types.h>
+#include <aspace.h>
+#include <fs/fs.h>
+
+/* Regions
+
+   A region describes a page aligned range of an address space and where
+   its pages come from. Nothing is mapped up front: the first access to a
+   page faults and region_fault maps it. Reserving a large range thus costs
+   only its descriptor.
+
+   Regions of an address space never overlap and are kept in a tree sorted
+   by address, protected by the address space's lock (taken with
+   tlb_mutex_lock, shootdowns happen while it is held).
+
+   Forking shares all frames of anonymous and file regions, writable ones
+   become read only with PAGE_COW set in both address spaces. The first
+   write copies the frame unless it has no other user left (refcount in
+   struct page). Shared file pages are not copied, every mapping holds a
+   page cache reference instead. */
+
+#define REGION_ANON     0       // Zeroed frames
+#define REGION_FILE     1       // Private copy of a file's blocks
+#define REGION_DEVICE   2       // Fixed physical range, e.g. MMIO
+#define REGION_SHARED   3       // File blocks in the page cache, writes go back to the file
+
+// Page fault error code
+#define PF_PRESENT      (1 << 0)    // Protection violation, not a missing page
+#define PF_WRITE        (1 << 1)
+#define PF_USER         (1 << 2)
+#define PF_FETCH        (1 << 4)
+
+struct region
+{
+    u64 start;
+    u64 end;
+    u64 type;
+    u64 flags;          // Page flags of the mappings
+
+    u64 phys;           // REGION_DEVICE: physical address of start
+
+    struct fs *fs;      // REGION_FILE and REGION_SHARED
+    i64 handle;
+    i64 offset;         // File offset of start, block aligned
+
+    bool dying;         // Being unmapped, stays in the tree to keep the range reserved
+
+    struct ktree_node tree_handle;
+};
+
+bool region_init();
+
+// Return false on overlap, misalignment or if out of memory
+bool region_map_anon(struct aspace *as, u64 start, u64 size, u64 flags);
+bool region_map_file(struct aspace *as, u64 start, u64 size, u64 flags, struct fs *fs, i64 handle, i64 offset);
+bool region_map_shared(struct aspace *as, u64 start, u64 size, u64 flags, struct fs *fs, i64 handle, i64 offset);
+bool region_map_device(struct aspace *as, u64 start, u64 size, u64 flags, u64 phys);
+
+// Removes the region starting at start and its mappings, returns false if there is none
+bool region_unmap(struct aspace *as, u64 start);
+
+// Writes back the dirty pages of the shared file region starting at start
+bool region_sync(struct aspace *as, u64 start);
+
+// Drops all regions of an address space which isn't active anywhere
+void region_clear(struct aspace *as);
+
+// Copies the regions and mappings of parent to the empty child, copy on write.
+// Fails on pages mapped outside of regions and on huge pages, the child is then
+// partially filled and has to be destroyed.
+bool region_fork(struct aspace *parent, struct aspace *child);
+
+// Resolves a page fault at addr in the current address space, false if it is a real fault.
+// intr tells if interrupts were enabled where the fault happened, they are enabled again
+// while the page is read, so the cpu keeps serving shootdowns.
+bool region_fault(u64 addr, u64 error, bool intr);
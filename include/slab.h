@@ -0,0 +1,81 @@
+#pragma once
+
+#include <pmm.h>
+#include <apic.h>
+#include <sync.h>
+#include <util.h>
+#include <types.h>
+
+/* Slab allocator
+
+   Small objects of one size are carved out of single pages (slabs), which
+   come from kmalloc. The chunk header kmalloc puts at the page start is
+   followed by the slab header and the objects, so the slab of an object is
+   found by masking its address. Every cache keeps a per cpu stack of free
+   objects in front of its slabs. */
+
+#define SLAB_NAME_LEN   16
+#define SLAB_CPU_CACHE  16  // Free objects per cpu
+#define SLAB_BATCH      8   // Objects moved between cpu stack and slabs at once
+#define SLAB_MAX_EMPTY  1   // Completely free slabs kept per cache
+
+struct kmem_cache;
+
+struct slab
+{
+    struct kmem_cache *cache;
+    struct slab *prev;
+    struct slab *next;
+    void *free;         // Free objects, linked through the objects
+    u64 in_use;         // Number of allocated objects
+};
+
+struct kmem_cpu_cache
+{
+    i64 count;
+    void *objs[SLAB_CPU_CACHE];
+    u64 allocs;
+    u64 frees;
+};
+
+struct kmem_cache
+{
+    char name[SLAB_NAME_LEN];
+    u64 obj_size;       // Requested size
+    u64 size;           // Size including free pointer and padding
+    u64 free_off;       // Offset of free pointer in object
+    u64 per_slab;       // Objects per slab
+    void (*ctor)(void*);
+
+    mutex_t lock;
+    struct slab *partial;   // Slabs with allocated and free objects
+    struct slab *full;      // Slabs without free objects
+    struct slab *empty;     // Slabs without allocated objects
+    u64 num_empty;
+    u64 num_slabs;
+    u64 peak_slabs;     // High-water mark of num_slabs
+
+    struct kmem_cpu_cache cpus[MAX_CPUS];
+
+    struct kmem_cache *next;    // List of all caches
+};
+
+// Largest object a cache can hold
+#define SLAB_MAX_OBJ 512
+
+/**
+ * Creates a cache for objects of size bytes aligned to align (power of two, 0 for default)
+ * ctor is run once per object when its slab is created, freed objects must be returned
+ * in constructed state. Returns NULL on failure.
+ */
+struct kmem_cache* kmem_cache_create(char *name, u64 size, u64 align, void (*ctor)(void*));
+
+// All objects must have been freed
+void kmem_cache_destroy(struct kmem_cache *cache);
+
+// Returns NULL if out of memory
+void* kmem_cache_alloc(struct kmem_cache *cache);
+void  kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+// Print usage of all caches
+void kmem_cache_dump_stats();
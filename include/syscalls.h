@@ -12,7 +12,8 @@
 
 /*
  * Struct used to refer to kernel stack on syscall 
- * from user mode and to save important user data
+ * from user mode and to save important user data,
+ * first member of every cpu's struct percpu
  */
 struct kernel_root
 {
@@ -22,5 +23,5 @@ struct kernel_root
     u64 user_rip;
 } __attribute__((packed));
 
-/* Setup fast syscalls */
+/* Setup fast syscalls on the executing cpu, after percpu_init */
 void syscalls_setup();
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <aspace.h>
+#include <types.h>
+
+/* TLB shootdown
+
+   Changes to mappings are collected in a batch of page ranges and flushed
+   at once: locally, with one IPI per cpu which has the address space
+   active, and lazily for cpus which only have stale PCID tagged entries
+   (their next switch to the address space flushes). Kernel mappings are
+   shared by all address spaces, so their batches go to every cpu. They
+   must be mapped PAGE_GLOBAL, invlpg then reaches them under any PCID. */
+
+#define TLB_MAX_RANGES      8
+#define TLB_MAX_PAGES       64      // Above this a full flush is cheaper than invlpg
+
+struct tlb_range
+{
+    u64 start;
+    u64 pages;
+};
+
+struct tlb_batch
+{
+    struct aspace *as;
+    u64 num_ranges;
+    struct tlb_range ranges[TLB_MAX_RANGES];
+    u64 pages;
+    bool full;          // Flush everything instead of the ranges
+};
+
+// Marks the executing cpu as able to receive shootdown IPIs (needs IDT and LAPIC)
+void tlb_cpu_init();
+
+void tlb_batch_init(struct tlb_batch *batch, struct aspace *as);
+// Adjacent and overlapping ranges are merged
+void tlb_batch_add(struct tlb_batch *batch, u64 addr, u64 pages);
+// Returns once all cpus have flushed, the batch is empty afterwards
+void tlb_batch_flush(struct tlb_batch *batch);
+
+// Called on INTR_NUM_TLB
+void tlb_handle_intr();
+
+// Spins on a lock with interrupts off like mutex_lock, but serves shootdowns meanwhile.
+// Locks which are held across tlb_batch_flush must be taken this way.
+void tlb_mutex_lock(mutex_t *lock);
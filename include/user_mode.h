@@ -33,4 +33,5 @@ struct tss_descriptor
     u32 reserved;
 } __attribute__((packed));
 
-void tss_init();
\ No newline at end of file
+// Fills tss with stack for interrupts from user mode and its descriptor in gdt (entries 5 and 6)
+void tss_init(struct task_state_segment *tss, u64 *gdt, u64 stack);
\ No newline at end of file
@@ -2,25 +2,24 @@
 
 #include <types.h>
 
-#define KTREE_LEFT  0
-#define KTREE_RIGHT 1
-
 #define OFFSET(type, member) ((i64)&(((type*)0)->member))
 #define ENCLAVE(type, member, ptr) (type*)(((void*)ptr) - (void*)(&((type*)0)->member))
 
+/* Intrusive red black tree, nodes are embedded into the sorted structs.
+   cmp(a, b) returns <0, 0 or >0 if a is smaller, equal or bigger than b. */
+
 struct ktree
 {
-    bool valid;
     struct ktree_node *root;
-} __attribute__((packed));
+};
 
 struct ktree_node
 {
-    bool valid[2];
     struct ktree_node *left;
     struct ktree_node *right;
     struct ktree_node *parent;
-} __attribute__((packed));
+    bool red;
+};
 
 /* GP methods */
 void bzero(u8 *mem, u64 size);
@@ -33,11 +32,12 @@ i64 abs(i64 x);
 
 bool ktree_empty(struct ktree *root);
 
+// Equal elements are allowed
 void ktree_insert(struct ktree *root, struct ktree_node *node, 
                   int off, int (*cmp)(void*, void*));
 
-void ktree_remove(struct ktree *root, struct ktree_node *node, 
-                  int off, int (*cmp)(void*, void*));
+// Node must be in the tree
+void ktree_remove(struct ktree *root, struct ktree_node *node);
 
 bool ktree_contains(struct ktree *root, void *val, 
                     int off, int (*cmp)(void*, void*));
@@ -46,6 +46,10 @@ bool ktree_find(struct ktree *root, void *val,
                     int off, int (*cmp)(void*, void*), 
                     struct ktree_node **res);
 
+// In order traversal, NULL if there is no (further) node
+struct ktree_node* ktree_first(struct ktree *root);
+struct ktree_node* ktree_next(struct ktree_node *node);
+
 struct klist
 {
     bool valid;
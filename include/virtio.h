@@ -89,5 +89,8 @@ bool virtio_dev_init(virtio_dev_t *virtio_dev, pci_dev_t *pci_dev, u16 num_queue
 bool virtio_dev_deinit(virtio_dev_t *virtio_dev);
 bool virtio_dev_reset(virtio_dev_t *virtio_dev);
 
+// Feature negotiation (legacy interface: 32 feature bits)
+u32 virtio_negotiate(virtio_dev_t *virtio_dev, u32 driver_features);
+
 bool virtio_create_queue(virtio_dev_t *virtio_dev, u16 queue_num);
 bool virtio_deploy(virtio_dev_t *virtio_dev, u16 queue_num, struct virtq_desc *descriptors, u16 num_descriptors);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <pmm.h>
+#include <slab.h>
 #include <types.h>
 #include <virtio.h>
 
@@ -10,8 +11,39 @@
 #define VIRTIO_BLK_T_SCSI_CMD_OUT 3
 #define VIRTIO_BLK_T_FLUSH 4
 #define VIRTIO_BLK_T_FLUSH_OUT 5
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
 #define VIRTIO_BLK_T_BARRIER 0x80000000
 
+/* Feature bits */
+#define VIRTIO_BLK_F_SIZE_MAX (1 << 1)      // Max size of any single segment is in size_max
+#define VIRTIO_BLK_F_SEG_MAX (1 << 2)       // Max number of segments in a request is in seg_max
+#define VIRTIO_BLK_F_BLK_SIZE (1 << 6)      // Logical block size of disk is in blk_size
+#define VIRTIO_BLK_F_TOPOLOGY (1 << 10)     // Physical block size and optimal io sizes are available
+#define VIRTIO_BLK_F_FLUSH (1 << 9)         // Device has write cache and supports flush
+#define VIRTIO_BLK_F_CONFIG_WCE (1 << 11)   // Write cache mode can be toggled via config
+#define VIRTIO_BLK_F_WRITE_ZEROES (1 << 14) // Device can zero sector ranges without data transfer
+
+/* Offsets in device specific config space */
+#define VIRTIO_BLK_CFG_CAPACITY 0x0
+#define VIRTIO_BLK_CFG_SIZE_MAX 0x8
+#define VIRTIO_BLK_CFG_SEG_MAX 0xC
+#define VIRTIO_BLK_CFG_BLK_SIZE 0x14
+#define VIRTIO_BLK_CFG_PHYS_BLOCK_EXP 0x18
+#define VIRTIO_BLK_CFG_ALIGNMENT_OFFSET 0x19
+#define VIRTIO_BLK_CFG_MIN_IO_SIZE 0x1A
+#define VIRTIO_BLK_CFG_OPT_IO_SIZE 0x1C
+#define VIRTIO_BLK_CFG_WRITEBACK 0x20
+#define VIRTIO_BLK_CFG_MAX_WRITE_ZEROES_SECTORS 0x30
+
+// Unmap flag for discard/write zeroes segments
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP 1
+
+// Unit of the sector field in requests, independent of blk_size
+#define VIRTIO_BLK_SECTOR_SIZE 512
+
+// Upper bound for data segments in one request
+#define VIRTIO_BLK_MAX_SEGS 64
+
 #define VIRTIO_BLK_S_OK 0
 #define VIRTIO_BLK_S_IOERR 1
 #define VIRTIO_BLK_S_UNSUPP 2
@@ -23,9 +55,41 @@ struct virtio_block_req_hdr
     u64 sector;
 }__attribute__((packed));
 
+// Device visible part of a request besides data (allocated from a slab cache)
+struct virtio_block_req
+{
+    struct virtio_block_req_hdr hdr;
+    u8 status;
+}__attribute__((packed));
+
+// Payload of discard and write zeroes requests
+struct virtio_block_discard_write_zeroes
+{
+    u64 sector;
+    u32 num_sectors;
+    u32 flags;
+}__attribute__((packed));
+
+// Data buffer of a (scatter gather) request
+struct virtio_block_seg
+{
+    u8 *data;
+    u32 len; // In bytes
+};
+
 typedef struct virtio_blk_dev
 {
     u64 size; // Size of disk in sectors
+    u32 features; // Negotiated features
+    bool writeback; // Device caches writes, flush needed for durability
+    u32 max_write_zeroes_sectors; // Max sectors per write zeroes request
+    u32 seg_max; // Max data segments per request
+    u32 size_max; // Max bytes per segment (0 means no limit)
+    u32 blk_size; // Logical block size in bytes, requests must be multiples of it
+    u32 phys_blk_size; // Physical block size in bytes, smaller writes cause read-modify-write on host
+    u64 align_offset; // Sector of the first physically aligned block
+    u32 min_io_size; // Min suggested request size in bytes
+    u32 opt_io_size; // Optimal request size in bytes (0 if unknown)
     virtio_dev_t *virtio_dev;
 } virtio_blk_dev_t;
 
@@ -34,9 +98,15 @@ bool virtio_block_dev_init(virtio_blk_dev_t *blk_dev, virtio_dev_t *virtio_dev);
 // Read/Write multiple sectors
 bool virtio_block_dev_write(virtio_blk_dev_t *blk_dev, u64 sector, u8 *data, u64 num_sectors);
 bool virtio_block_dev_read(virtio_blk_dev_t *blk_dev, u64 sector, u8 *data, u64 num_sectors);
+// Write scattered buffers to consecutive sectors
+bool virtio_block_dev_writev(virtio_blk_dev_t *blk_dev, u64 sector, struct virtio_block_seg *segs, u16 num_segs);
 // Read/Write single sector
 bool virtio_block_dev_write_block(virtio_blk_dev_t *blk_dev, u64 sector, u8 *data);
 bool virtio_block_dev_read_block(virtio_blk_dev_t *blk_dev, u64 sector, u8 *data);
 // Clear single sector
 bool virtio_block_dev_zero(virtio_blk_dev_t *blk_dev, u64 sector);
+// Zero sector range without transferring data (unmap: allow deallocation on host)
+bool virtio_block_dev_write_zeroes(virtio_blk_dev_t *blk_dev, u64 sector, u64 num_sectors, bool unmap);
+// Make all completed writes durable (no-op on write through devices)
+bool virtio_block_dev_flush(virtio_blk_dev_t *blk_dev);
 
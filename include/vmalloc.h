@@ -0,0 +1,34 @@
+#pragma once
+
+#include <pmm.h>
+#include <vmm.h>
+#include <sync.h>
+#include <util.h>
+#include <types.h>
+
+/* Kernel virtual memory allocator
+
+   Maps single frames into a contiguous range of kernel virtual memory, so
+   big buffers don't need physically contiguous memory. The range has its
+   own slot in the kernel PML4, outside of the identity mapping. Every
+   area is followed by an unmapped guard page, and the range starts with
+   one, so overruns in both directions fault. */
+
+#define VMALLOC_SLOT    510
+#define VMALLOC_START   0xFFFFFF0000000000     // Sign extended start of PML4 slot 510
+#define VMALLOC_END     0xFFFFFF8000000000
+#define VMALLOC_GUARD   PAGE_SIZE
+
+struct vm_area
+{
+    u64 addr;       // First mapped page
+    u64 pages;      // Number of mapped pages (without guard)
+    struct ktree_node tree_handle;
+};
+
+// Sets up the PML4 slot, must run after the frame allocator and identity mapping
+bool vmalloc_init();
+
+// Returns -1 on failure, memory isn't physically contiguous and not zeroed
+i64 vmalloc(i64 size);
+i64 vfree(i64 addr);
@@ -12,7 +12,26 @@
 #define PAGE_DIRTY      (1 << 6)     // Set by cpu on write to this page
 #define PAGE_HUGE       (1 << 7)     // Creates 1GiB page in level 3 and a 2MiB Page in level 2
 #define PAGE_GLOBAL     (1 << 8)     // Page won't be flushed from caches on addr space switch, but PGE bit in CR4 must be set
-#define PAGE_NO_EXEC    (1 << 63)    // Page isn't executable, NXE bit in EFER must be set
+#define PAGE_NO_EXEC    (1ULL << 63) // Page isn't executable, NXE bit in EFER must be set
+
+// Bits 9 to 11 are ignored by the cpu and free for the kernel
+#define PAGE_COW        (1 << 9)     // Read only because the frame is shared, copied on write
+
+// Flag bits of an entry which fit into the flags of paging_map
+#define PAGE_FLAGS_MASK (0xFFF | PAGE_NO_EXEC)
+
+// Control bits paging_cpu_init sets
+#define MSR_EFER        0xC0000080
+#define EFER_NXE        (1 << 11)    // PAGE_NO_EXEC is valid
+#define CR4_PGE         (1 << 7)     // PAGE_GLOBAL is valid
+#define CR0_WP          (1 << 16)    // Read only pages are read only for the kernel too
+
+// Physical address bits of an entry
+#define PAGE_ADDR_MASK  0x000FFFFFFFFFF000ULL
+
+// Index and size of entries in level 1 (4KiB) to 4 (512GiB)
+#define PAGE_INDEX(level, x) (((x) >> (12 + 9 * ((level) - 1))) & 0x1FF)
+#define PAGE_LEVEL_SIZE(level) (1ULL << (12 + 9 * ((level) - 1)))
 
 // This struct is used as table, directory and pointer.
 struct page_table
@@ -20,13 +39,101 @@ struct page_table
     u64 entries[512];
 } __attribute__((packed));
 
-// Initial identity mapping
-void paging_id_full();
+/* Identity mapping
+
+   bootloader.asm maps the first 4 GiB with 2 MiB pages (one directory
+   pointer table and four directories). paging_id_full extends this to all
+   of ram, with 1 GiB pages if the cpu supports them and 2 MiB pages
+   otherwise. One directory pointer table limits it to 512 GiB. */
+
+#define PAGE_ID_NUM_DIRS 1
+#define PAGE_ID_NUM_TABS 4
+#define PAGE_ID_BOOT_END 0x100000000         // End of the boot time mapping
+#define PAGE_ID_LIMIT    0x8000000000        // End of what can be mapped
+
+extern struct page_table page_id_ptr;
+extern struct page_table page_id_dir[PAGE_ID_NUM_DIRS];
+extern struct page_table page_id_tab[PAGE_ID_NUM_TABS];
+
+// Whether the cpu supports 1 GiB pages
+bool paging_huge_1g();
+
+// Whether the cpu supports PAGE_NO_EXEC
+bool paging_nx();
+
+// Enables no execute, global pages and write protection for the kernel on the executing cpu
+void paging_cpu_init();
+
+// PAGE_NO_EXEC if paging_cpu_init enabled it, 0 otherwise (the bit is reserved without NXE)
+u64 paging_no_exec();
+
+// Number of directories paging_id_full needs for the 2 MiB fallback
+u64 paging_id_tables(u64 end);
+
+// Identity map [0, max(end, 4 GiB)), tables has room for paging_id_tables(end) directories.
+// Everything above the first GiB is global and not executable.
+void paging_id_full(u64 end, struct page_table *tables);
+
+/* Kernel image protection
+
+   linker.ld puts the sections of the kernel on page boundaries.
+   paging_protect_kernel maps the first GiB with flags per section:
+   .text (and the AP trampoline at 0x8000) read only and executable,
+   .rodata read only, everything else writable and not executable. All of
+   it is global, the identity map is the same in every address space. */
+
+// Returns false if a page table couldn't be allocated
+bool paging_protect_kernel();
 
 // Load page table
 void paging_activate(struct page_table *table);
 
 // General Purpose functions
-void paging_map(struct page_table *p4, u64 virt_addr, u64 phys_addr, u16 flags);
-void paging_map_range(struct page_table *p4, u64 virt_addr, u64 phys_addr, u16 flags, u64 size, u64 page_size);
-u64 paging_walk(struct page_table *p4, u64 virt_addr);
\ No newline at end of file
+// Returns false if a page table couldn't be allocated
+bool paging_map(struct page_table *p4, u64 virt_addr, u64 phys_addr, u64 flags);
+// Maps with pages of up to page_size (4KiB, 2MiB or 1GiB) where alignment and size allow,
+// huge pages that are partially remapped are split. A huge page replacing a table flushes
+// the TLBs of all cpus, so no lock may be held that is taken without tlb_mutex_lock.
+bool paging_map_range(struct page_table *p4, u64 virt_addr, u64 phys_addr, u64 flags, u64 size, u64 page_size);
+u64 paging_walk(struct page_table *p4, u64 virt_addr);
+// Entry of the 4k page at virt_addr for in place changes, huge pages are split, NULL if a table is missing
+u64* paging_leaf(struct page_table *p4, u64 virt_addr);
+
+// Frees a table (entries in level 1 to 4) and the tables below it, mapped frames are kept
+void paging_free_table(struct page_table *table, u64 level);
+
+// Removes the mapping of a 4k page, returns its physical address or -1 if it wasn't mapped
+u64 paging_unmap(struct page_table *p4, u64 virt_addr);
+
+// Drop the executing cpu's TLB entry of a page
+void paging_invalidate(u64 virt_addr);
+
+/* Page table cursor
+
+   A cursor remembers the tables it walked through for the last address.
+   The next address only walks the levels below the lowest remembered
+   table which covers it too, so a range touches each upper table once
+   instead of once per page. Changing the tables other than through the
+   cursor (splitting or replacing tables) invalidates it, init it again.
+
+   Unlike paging_map and paging_unmap, cursor unmaps don't flush the TLB,
+   callers batch that. */
+
+struct paging_cursor
+{
+    struct page_table *tables[5];   // tables[l] holds the entries of level l (1 to 4)
+    u64 tags[4];                    // Virtual address / range of tables[l]
+    u64 *links[4];                  // Entry pointing to tables[l]
+};
+
+void paging_cursor_init(struct paging_cursor *cur, struct page_table *p4);
+
+// Maps one page of level 1 (4KiB), 2 (2MiB) or 3 (1GiB), returns false if a table couldn't be allocated
+bool paging_cursor_map(struct paging_cursor *cur, u64 virt_addr, u64 phys_addr, u64 flags, u64 level);
+// Entry of the 4k page at virt_addr, huge pages are split, NULL if a table is missing
+u64* paging_cursor_leaf(struct paging_cursor *cur, u64 virt_addr);
+// Clears the 4k entry at virt_addr and returns its old value, 0 if it wasn't mapped
+u64 paging_cursor_unmap(struct paging_cursor *cur, u64 virt_addr);
+// First page in [virt_addr, end) that is mapped (4k or huge), end if none.
+// Ranges of missing tables are skipped as a whole.
+u64 paging_cursor_next(struct paging_cursor *cur, u64 virt_addr, u64 end);
@@ -0,0 +1,94 @@
+#include <acpi.h>
+
+static bool acpi_checksum(u8 *ptr, u64 len)
+{
+    u8 sum = 0;
+
+    for(u64 i = 0; i < len; i++)
+    {
+        sum += ptr[i];
+    }
+
+    return sum == 0;
+}
+
+static struct acpi_rsdp* acpi_search_sig(u8 *space, i64 len)
+{
+    // RSDP is always aligned to a 16 byte boundary
+    for(i64 i = 0; i < len; i += 16)
+    {
+        struct acpi_rsdp *rsdp = (struct acpi_rsdp*)(space + i);
+
+        if(memcmp((u8*)rsdp->signature, (u8*)"RSD PTR ", 8) &&
+           acpi_checksum((u8*)rsdp, 20))
+        {
+            return rsdp;
+        }
+    }
+    // Not found
+    return NULL;
+}
+
+struct acpi_rsdp* acpi_search_rsdp()
+{
+    struct acpi_rsdp *ptr;
+
+    // Search in first kilobyte of EBDA
+    u16 *ebda_ptr = (u16*)0x40E;
+    u8 *ebda_addr = (u8*)(((u64)*ebda_ptr) << 4);
+    ptr = acpi_search_sig(ebda_addr, 1024);
+    if(ptr != NULL)
+        return ptr;
+
+    // Search in the bios rom
+    ptr = acpi_search_sig((u8*)0xE0000, 0xFFFFF - 0xE0000);
+    if(ptr != NULL)
+        return ptr;
+
+    // Not found
+    return NULL;
+}
+
+struct acpi_sdt_hdr* acpi_find_table(char *signature)
+{
+    struct acpi_rsdp *rsdp = acpi_search_rsdp();
+
+    if(rsdp == NULL)
+        return NULL;
+
+    // Prefer XSDT (64 bit pointers) if available
+    bool xsdt = rsdp->revision >= 2 && rsdp->xsdt_addr != 0;
+
+    struct acpi_sdt_hdr *root = xsdt ?
+        (struct acpi_sdt_hdr*)rsdp->xsdt_addr :
+        (struct acpi_sdt_hdr*)(u64)rsdp->rsdt_addr;
+
+    if(!acpi_checksum((u8*)root, root->length))
+        return NULL;
+
+    // Pointer array follows the header
+    u64 ptr_size = xsdt ? 8 : 4;
+    u64 num_entries = (root->length - sizeof(struct acpi_sdt_hdr)) / ptr_size;
+    u8 *entries = ((u8*)root) + sizeof(struct acpi_sdt_hdr);
+
+    for(u64 i = 0; i < num_entries; i++)
+    {
+        struct acpi_sdt_hdr *table = xsdt ?
+            (struct acpi_sdt_hdr*)(*(u64*)(entries + i * 8)) :
+            (struct acpi_sdt_hdr*)(u64)(*(u32*)(entries + i * 4));
+
+        if(memcmp((u8*)table->signature, (u8*)signature, 4) &&
+           acpi_checksum((u8*)table, table->length))
+        {
+            return table;
+        }
+    }
+
+    // Not found
+    return NULL;
+}
+
+i64 acpi_mcfg_num_entries(struct acpi_mcfg *mcfg)
+{
+    return (mcfg->hdr.length - sizeof(struct acpi_mcfg)) / sizeof(struct acpi_mcfg_entry);
+}
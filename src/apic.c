@@ -3,6 +3,11 @@
 #include <pmm.h>
 #include <vga.h>
 #include <apic.h>
+#include <tlb.h>
+#include <intr.h>
+#include <aspace.h>
+#include <percpu.h>
+#include <vmalloc.h>
 
 static bool mp_fps_valid(struct mp_fps *fps)
 {
@@ -312,6 +317,13 @@ u8 lapic_id(lapic_t lapic)
     return (u8)(mmio_readd(lapic + LAPIC_ID) >> 24);
 }
 
+u8 cpu_id()
+{
+    u32 regs[4];
+    cpuid(1, 0, regs);
+    return (u8)(regs[1] >> 24);
+}
+
 void lapic_end_of_int(lapic_t lapic)
 {
     mmio_writed(lapic + LAPIC_EOI, 0);
@@ -442,6 +454,23 @@ static void lapic_ipi_startup(lapic_t lapic, u8 lapic_dst_id, u8 vector)
               vector);
 }
 
+void lapic_ipi_fixed(lapic_t lapic, u8 lapic_dst_id, u8 vector)
+{
+    // Previous IPI must have left the ICR
+    while((mmio_readd(lapic + LAPIC_ICR_LOW) >> 12) & 1)
+    {
+        __asm__ volatile("pause");
+    }
+
+    lapic_ipi(lapic,
+              lapic_dst_id,
+              IPI_SHORTHAND_NO,
+              IPI_TRIGGER_EDGE,
+              IPI_LEVEL_ASSERT,
+              IPI_DELIVERY_FIXED,
+              vector);
+}
+
 /**
  * Checks if last ipi was successfully delivered
  */
@@ -480,15 +509,18 @@ bool lapic_boot_ap(lapic_t lapic, u8 lapic_dst_id)
 {
     bool dispatched;
 
-    // Initialize smp boot params (for each core)
-    smp_boot_params.stack_pointer = (u8*)kmalloc(SMP_STACK_SIZE);
+    // Initialize smp boot params (for each core), stack is guarded against overflows
+    i64 stack = vmalloc(SMP_STACK_SIZE);
     
     // Check for error
-    if((i64)smp_boot_params.stack_pointer < 0)
+    if(stack == -1)
     {
         goto fail;
     }
 
+    // Stack grows down
+    smp_boot_params.stack_pointer = (u8*)(stack + SMP_STACK_SIZE);
+
     // Configure timer (1 tick = 200 usec)
     pit_freq(5000);
 
@@ -535,8 +567,30 @@ fail:
 /**
  * Method that is called by the AP after it was successfully started, entry to c code
  */
-void smp_ap_boot()
+void smp_ap_boot(u64 stack)
 {
+    // The cpu can't run anything without its data
+    if(!percpu_init(stack))
+    {
+        while(1)
+            __asm__ volatile("cli; hlt");
+    }
+
+    paging_cpu_init();
+    aspace_cpu_init();
+    syscalls_setup();
+
+    // Take part in TLB shootdowns
+    intr_ap_setup();
+    lapic_init(0xF1, 0xF2, 0xF3, 0xF4);
+    tlb_cpu_init();
+    intr_enable();
+
     kprintf("AP booted succesfully\n");
-    while(1); // TODO: Do something usefull   
+
+    // TODO: Do something usefull
+    while(1)
+    {
+        __asm__ volatile("hlt");
+    }
 }
\ No newline at end of file
@@ -174,10 +174,10 @@ align 4096
 resb (16384 * 2)
 kernel_stack:
 
-; identity mapping for whole virtual address space
+; identity mapping of the first 4GiB (extended by paging_id_full)
 page_id_ptr:
     resb 4096
 page_id_dir:
-    resb 4096 * 512
+    resb 4096
 page_id_tab:
-    resb 4096 * 512 * 512
+    resb 4096 * 4
@@ -17,6 +17,11 @@ section .text
 global isr_%1
 
 isr_%1:
+    ; The cpu pushes an error code for these exceptions only, push a dummy one
+    ; for the rest so that every frame looks the same
+%if %1 != 8 && %1 != 10 && %1 != 11 && %1 != 12 && %1 != 13 && %1 != 14 && %1 != 17 && %1 != 21 && %1 != 29 && %1 != 30
+    push qword 0
+%endif
     push qword %1
     jmp isr_stub
 
@@ -85,20 +90,33 @@ isr_macro c
 ; General handler which saves and restores the interrupt context
 isr_stub:
 
+    ; gs holds the user's base when coming from ring 3, get the cpu's data
+    test qword [rsp+24], 3
+    jz .kernel_entry
+    swapgs
+.kernel_entry:
+
     ; save context
     save_context
     
     ; call c handler
     mov rdi, rsp          ; pointer to saved vars
     mov rsi, [rsp+(15*8)] ; pass saved interrupt code
+    mov rdx, [rsp+(16*8)] ; pass error code
     call intr_handler
     mov rsp, rax          ; restore saved context
 
     ; restore context
     restore_context
 
-    ; remove interrupt code (pushed by the ISRs) from stack
-    add rsp, 8
+    ; remove interrupt and error code from stack
+    add rsp, 16
+
+    ; the returned context may be another one, check its cs
+    test qword [rsp+8], 3
+    jz .kernel_exit
+    swapgs
+.kernel_exit:
 
     ; return from interrupt
     iretq
@@ -108,5 +126,10 @@ isr_stub:
 switch_context:
     ; Load interrupt context
     mov rsp, rdi
+    ; User mode gets its own gs base
+    test qword [rsp+8], 3
+    jz .kernel
+    swapgs
+.kernel:
     ; Do actual switch
     iretq
\ No newline at end of file
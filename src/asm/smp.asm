@@ -81,9 +81,18 @@ bits 32
     or eax, 1 << 5
     mov cr4, eax 
 
+    ; no execute bit is used by the page tables if the cpu has it
+    mov eax, 0x80000001
+    cpuid
+    mov ebx, edx
+
     mov ecx, 0xC0000080
     rdmsr
     or eax, 1 << 8
+    bt ebx, 20
+    jnc .no_nx
+    or eax, 1 << 11
+.no_nx:
     wrmsr
 
     mov eax, cr0
@@ -109,8 +118,9 @@ bits 64
     mov gs, ax
     mov ss, ax
 
-    ; setup stack
+    ; setup stack, smp_ap_boot keeps it as kernel stack
     mov rsp, [smp_boot_params+0]
+    mov rdi, rsp
 
     ; let BSP know that we came this far
     mov qword [smp_boot_params+8], 1
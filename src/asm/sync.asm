@@ -22,9 +22,9 @@ atomic_sub:
 ; atomic_tas(bool *atomic_flag)
 atomic_tas:
     xor rax, rax
-    mov rsi, 1
-    xchg [rdi], si
-    mov ax, si 
+    mov sil, 1
+    xchg [rdi], sil ; flag is a single byte
+    mov al, sil
     ret
 
 ; atomic clear
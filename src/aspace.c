@@ -0,0 +1,181 @@
+#include <io.h>
+#include <intr.h>
+#include <frame.h>
+#include <region.h>
+#include <aspace.h>
+#include <percpu.h>
+
+static struct aspace aspace_kernel_space = {.root = &page_id_ptr, .pcid = 0, .tlb_cpus = 0xFFFFFFFFFFFFFFFF, .active_cpus = 0, .lock = 0, .regions = {NULL}};
+
+static bool aspace_pcid = false;
+
+// Allocated PCIDs, PCID 0 is the kernel's
+static u64 aspace_pcids[ASPACE_NUM_PCIDS / 64] = {1};
+static mutex_t aspace_pcids_lock = 0;
+
+void aspace_cpu_init()
+{
+    u32 regs[4];
+    cpuid(1, 0, regs);
+
+    // PCID is supported if CPUID.1:ECX bit 17 is set, CR3 is loaded with PCID 0 at this point
+    if(regs[2] & (1 << 17))
+    {
+        wcr4(rcr4() | CR4_PCIDE);
+        aspace_pcid = true;
+    }
+
+    this_cpu()->aspace = &aspace_kernel_space;
+    __atomic_fetch_or(&aspace_kernel_space.active_cpus, 1ULL << this_cpu()->id, __ATOMIC_SEQ_CST);
+}
+
+static u16 aspace_pcid_alloc()
+{
+    if(!aspace_pcid)
+        return ASPACE_NO_PCID;
+
+    u16 ret = ASPACE_NO_PCID;
+
+    mutex_lock(&aspace_pcids_lock);
+
+    for(u64 i = 0; i < ASPACE_NUM_PCIDS / 64; i++)
+    {
+        if(aspace_pcids[i] != 0xFFFFFFFFFFFFFFFF)
+        {
+            u64 bit = __builtin_ctzll(~aspace_pcids[i]);
+            aspace_pcids[i] |= 1ULL << bit;
+            ret = i * 64 + bit;
+            break;
+        }
+    }
+
+    mutex_unlock(&aspace_pcids_lock);
+
+    return ret;
+}
+
+static void aspace_pcid_free(u16 pcid)
+{
+    if(pcid == ASPACE_NO_PCID || pcid == 0)
+        return;
+
+    mutex_lock(&aspace_pcids_lock);
+    aspace_pcids[pcid / 64] &= ~(1ULL << (pcid % 64));
+    mutex_unlock(&aspace_pcids_lock);
+}
+
+struct aspace* aspace_create()
+{
+    i64 addr = kmalloc(sizeof(struct aspace));
+    if(addr == -1)
+        return NULL;
+
+    struct aspace *as = (struct aspace*)addr;
+
+    i64 root = frame_zalloc(0);
+    if(root == -1)
+    {
+        kfree(addr);
+        return NULL;
+    }
+
+    as->root = (struct page_table*)root;
+    as->pcid = aspace_pcid_alloc();
+    as->tlb_cpus = 0;
+    as->active_cpus = 0;
+    as->lock = 0;
+    as->regions.root = NULL;
+
+    // Share the kernel's tables
+    as->root->entries[0] = page_id_ptr.entries[0];
+    for(u64 i = 256; i < 512; i++)
+    {
+        as->root->entries[i] = page_id_ptr.entries[i];
+    }
+
+    return as;
+}
+
+void aspace_destroy(struct aspace *as)
+{
+    if(as == &aspace_kernel_space)
+        return;
+
+    region_clear(as);
+
+    // User part only, the rest belongs to the kernel
+    for(u64 i = 1; i < 256; i++)
+    {
+        u64 entry = as->root->entries[i];
+
+        if(entry & PAGE_PRESENT)
+            paging_free_table((struct page_table*)(entry & PAGE_ADDR_MASK), 3);
+    }
+
+    frame_free((u64)as->root);
+
+    // Stale entries are flushed by the first switch of every cpu to the next owner
+    aspace_pcid_free(as->pcid);
+
+    kfree((i64)as);
+}
+
+struct aspace* aspace_fork(struct aspace *parent)
+{
+    struct aspace *child = aspace_create();
+    if(child == NULL)
+        return NULL;
+
+    if(!region_fork(parent, child))
+    {
+        aspace_destroy(child);
+        return NULL;
+    }
+
+    return child;
+}
+
+void aspace_switch(struct aspace *as)
+{
+    u64 flags = intr_save();
+
+    u8 cpu = this_cpu()->id;
+
+    u64 cr3 = (u64)as->root;
+
+    // Shootdowns must see the cpu as active before the flush decision below
+    struct aspace *prev = aspace_current();
+    __atomic_fetch_and(&prev->active_cpus, ~(1ULL << cpu), __ATOMIC_SEQ_CST);
+    __atomic_fetch_or(&as->active_cpus, 1ULL << cpu, __ATOMIC_SEQ_CST);
+
+    if(aspace_pcid && as->pcid != ASPACE_NO_PCID)
+    {
+        cr3 |= as->pcid;
+
+        // Entries of a previous owner of the PCID may still be cached here
+        if(__atomic_fetch_or(&as->tlb_cpus, 1ULL << cpu, __ATOMIC_SEQ_CST) & (1ULL << cpu))
+            cr3 |= CR3_NO_FLUSH;
+    }
+
+    this_cpu()->aspace = as;
+
+    __asm__ volatile("mov %0, %%cr3" : : "r" (cr3) : "memory");
+
+    intr_restore(flags);
+}
+
+struct aspace* aspace_kernel()
+{
+    return &aspace_kernel_space;
+}
+
+struct aspace* aspace_current()
+{
+    struct aspace *as = this_cpu()->aspace;
+    return (as != NULL) ? as : &aspace_kernel_space;
+}
+
+bool aspace_pcid_enabled()
+{
+    return aspace_pcid;
+}
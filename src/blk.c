@@ -0,0 +1,353 @@
+#include <blk.h>
+
+bool blk_queue_init(struct blk_queue *queue, virtio_blk_dev_t *dev)
+{
+    queue->dev = dev;
+    queue->num_reqs = 0;
+    queue->seq = 0;
+
+    // Write granularity which avoids read-modify-write on the host
+    queue->lblk_sectors  = dev->blk_size / BLK_SECTOR_SIZE;
+    queue->align_sectors = max(dev->phys_blk_size, dev->min_io_size) / BLK_SECTOR_SIZE;
+    queue->align_phase   = dev->align_offset % queue->align_sectors;
+
+    // Largest segment the device accepts (whole aligned units)
+    queue->seg_sectors = BLK_MAX_REQ_SECTORS;
+    if(dev->size_max != 0)
+    {
+        queue->seg_sectors = min(queue->seg_sectors, dev->size_max / BLK_SECTOR_SIZE);
+    }
+    queue->seg_sectors -= queue->seg_sectors % queue->align_sectors;
+    queue->seg_sectors  = max(queue->align_sectors, queue->seg_sectors);
+
+    // Largest request the device accepts, preferably a multiple of the optimal io size
+    queue->max_sectors = max(queue->seg_sectors, 
+                             min(BLK_MAX_REQ_SECTORS, queue->seg_sectors * dev->seg_max));
+
+    u64 opt_sectors = dev->opt_io_size / BLK_SECTOR_SIZE;
+    if(opt_sectors != 0 && queue->max_sectors >= opt_sectors)
+    {
+        queue->max_sectors -= queue->max_sectors % opt_sectors;
+    }
+
+    queue->reqs = (struct blk_req*)kmalloc(BLK_QUEUE_DEPTH * sizeof(struct blk_req));
+
+    return (i64)queue->reqs != -1;
+}
+
+void blk_queue_deinit(struct blk_queue *queue)
+{
+    blk_dispatch(queue);
+    kfree((i64)queue->reqs);
+}
+
+static bool blk_overlaps(struct blk_req *req, u64 sector, u64 num_sectors)
+{
+    return sector < (req->sector + req->num_sectors) && req->sector < (sector + num_sectors);
+}
+
+static bool blk_contains(struct blk_req *req, u64 sector, u64 num_sectors)
+{
+    return sector >= req->sector && (sector + num_sectors) <= (req->sector + req->num_sectors);
+}
+
+// Is x a multiple of unit (shifted by phase)?
+static bool blk_aligned(u64 x, u64 unit, u64 phase)
+{
+    return ((x + unit - phase) % unit) == 0;
+}
+
+// Round down to multiple of unit (shifted by phase)
+static u64 blk_align_down(u64 x, u64 unit, u64 phase)
+{
+    return x - ((x + unit - phase) % unit);
+}
+
+// Sort pending writes by LBA (insertion sort, queue is short)
+static void blk_sort(struct blk_queue *queue)
+{
+    for(i64 i = 1; i < queue->num_reqs; i++)
+    {
+        struct blk_req key = queue->reqs[i];
+        i64 j = i - 1;
+
+        while(j >= 0 && queue->reqs[j].sector > key.sector)
+        {
+            queue->reqs[j + 1] = queue->reqs[j];
+            j--;
+        }
+
+        queue->reqs[j + 1] = key;
+    }
+}
+
+bool blk_dispatch(struct blk_queue *queue)
+{
+    struct virtio_block_seg segs[VIRTIO_BLK_MAX_SEGS];
+    bool ret = true;
+
+    blk_sort(queue);
+
+    i64 i = 0;
+    while(i < queue->num_reqs)
+    {
+        struct blk_req *first = &queue->reqs[i];
+
+        u64 sectors = first->num_sectors;
+        u16 count = 1;
+
+        segs[0].data = first->data;
+        segs[0].len  = first->num_sectors * BLK_SECTOR_SIZE;
+
+        // Merge following writes as long as they are adjacent and fit into one request
+        while((i + count) < queue->num_reqs && count < queue->dev->seg_max)
+        {
+            struct blk_req *prev = &queue->reqs[i + count - 1];
+            struct blk_req *next = &queue->reqs[i + count];
+
+            if(next->sector != prev->sector + prev->num_sectors ||
+               sectors + next->num_sectors > queue->max_sectors)
+            {
+                break;
+            }
+
+            segs[count].data = next->data;
+            segs[count].len  = next->num_sectors * BLK_SECTOR_SIZE;
+
+            sectors += next->num_sectors;
+            count++;
+        }
+
+        if(!virtio_block_dev_writev(queue->dev, first->sector, segs, count))
+            ret = false;
+
+        // Release private copies
+        for(u16 j = 0; j < count; j++)
+        {
+            kfree((i64)queue->reqs[i + j].data);
+        }
+
+        i += count;
+    }
+
+    queue->num_reqs = 0;
+
+    return ret;
+}
+
+bool blk_flush(struct blk_queue *queue)
+{
+    bool ret = blk_dispatch(queue);
+    return virtio_block_dev_flush(queue->dev) && ret;
+}
+
+/**
+ * Queues a write that fits into a single segment
+ */
+static bool __blk_write(struct blk_queue *queue, u64 sector, u8 *data, u64 num_sectors)
+{
+    for(i64 i = 0; i < queue->num_reqs; i++)
+    {
+        struct blk_req *req = &queue->reqs[i];
+
+        // Rewrite of a pending range, just replace data
+        if(req->sector == sector && req->num_sectors == num_sectors)
+        {
+            memcpy(req->data, data, num_sectors * BLK_SECTOR_SIZE);
+            return true;
+        }
+
+        // Partial overlap, keep write order by submitting everything before
+        if(blk_overlaps(req, sector, num_sectors))
+        {
+            if(!blk_dispatch(queue))
+                return false;
+            break;
+        }
+    }
+
+    if(queue->num_reqs == BLK_QUEUE_DEPTH)
+    {
+        if(!blk_dispatch(queue))
+            return false;
+    }
+
+    i64 buf = kmalloc(num_sectors * BLK_SECTOR_SIZE);
+
+    // Out of memory, write through
+    if(buf == -1)
+    {
+        if(!blk_dispatch(queue))
+            return false;
+        return virtio_block_dev_write(queue->dev, sector, data, num_sectors);
+    }
+
+    memcpy((u8*)buf, data, num_sectors * BLK_SECTOR_SIZE);
+
+    struct blk_req *req = &queue->reqs[queue->num_reqs];
+    req->sector = sector;
+    req->num_sectors = num_sectors;
+    req->seq = queue->seq;
+    req->data = (u8*)buf;
+
+    queue->num_reqs++;
+    queue->seq++;
+
+    // Oldest write sits first since the queue is in arrival order until dispatched
+    if(queue->seq - queue->reqs[0].seq >= BLK_DEADLINE)
+    {
+        return blk_dispatch(queue);
+    }
+
+    return true;
+}
+
+// Split into segments the device accepts
+static bool blk_write_segs(struct blk_queue *queue, u64 sector, u8 *data, u64 num_sectors)
+{
+    while(num_sectors > 0)
+    {
+        u64 count = min(num_sectors, queue->seg_sectors);
+
+        if(!__blk_write(queue, sector, data, count))
+            return false;
+
+        sector += count;
+        data += count * BLK_SECTOR_SIZE;
+        num_sectors -= count;
+    }
+
+    return true;
+}
+
+/**
+ * Widens a write to whole physical blocks by reading the surrounding data
+ */
+static bool blk_write_rmw(struct blk_queue *queue, u64 sector, u8 *data, u64 num_sectors)
+{
+    u64 start = blk_align_down(sector, queue->align_sectors, queue->align_phase);
+    u64 end   = blk_align_down(sector + num_sectors + queue->align_sectors - 1, 
+                               queue->align_sectors, queue->align_phase);
+
+    // Aligned start may lie before the disk start
+    if(start > sector)
+        return false;
+
+    // Last physical block may be cut off by the disk end
+    end = min(end, queue->dev->size);
+
+    i64 buf = kmalloc((end - start) * BLK_SECTOR_SIZE);
+    if(buf == -1)
+        return false;
+
+    bool ret = blk_read(queue, start, (u8*)buf, end - start);
+
+    if(ret)
+    {
+        memcpy((u8*)buf + (sector - start) * BLK_SECTOR_SIZE, data, num_sectors * BLK_SECTOR_SIZE);
+        // Not through blk_write, a cut off tail is as aligned as it gets
+        ret = blk_write_segs(queue, start, (u8*)buf, end - start);
+    }
+
+    kfree(buf);
+
+    return ret;
+}
+
+bool blk_write(struct blk_queue *queue, u64 sector, u8 *data, u64 num_sectors)
+{
+    // Nothing may reach past the disk end
+    if(sector > queue->dev->size || num_sectors > queue->dev->size - sector)
+        return false;
+
+    // Device rejects partial logical blocks
+    if(!blk_aligned(sector, queue->lblk_sectors, 0) || 
+       !blk_aligned(num_sectors, queue->lblk_sectors, 0))
+    {
+        return false;
+    }
+
+    // Partial physical blocks would cause read-modify-write on the host
+    if(!blk_aligned(sector, queue->align_sectors, queue->align_phase) ||
+       !blk_aligned(num_sectors, queue->align_sectors, 0))
+    {
+        return blk_write_rmw(queue, sector, data, num_sectors);
+    }
+
+    return blk_write_segs(queue, sector, data, num_sectors);
+}
+
+bool blk_read(struct blk_queue *queue, u64 sector, u8 *data, u64 num_sectors)
+{
+    for(i64 i = 0; i < queue->num_reqs; i++)
+    {
+        struct blk_req *req = &queue->reqs[i];
+
+        // Serve from pending write
+        if(blk_contains(req, sector, num_sectors))
+        {
+            memcpy(data, req->data + (sector - req->sector) * BLK_SECTOR_SIZE,
+                   num_sectors * BLK_SECTOR_SIZE);
+            return true;
+        }
+
+        // Device must see pending data before we read it back
+        if(blk_overlaps(req, sector, num_sectors))
+        {
+            if(!blk_dispatch(queue))
+                return false;
+            break;
+        }
+    }
+
+    while(num_sectors > 0)
+    {
+        u64 count = min(num_sectors, queue->seg_sectors);
+
+        if(!virtio_block_dev_read(queue->dev, sector, data, count))
+            return false;
+
+        sector += count;
+        data += count * BLK_SECTOR_SIZE;
+        num_sectors -= count;
+    }
+
+    return true;
+}
+
+bool blk_write_zeroes(struct blk_queue *queue, u64 sector, u64 num_sectors, bool unmap)
+{
+    i64 i = 0;
+    while(i < queue->num_reqs)
+    {
+        struct blk_req *req = &queue->reqs[i];
+
+        // Pending write is overwritten anyway, drop it
+        if(sector <= req->sector &&
+           (req->sector + req->num_sectors) <= (sector + num_sectors))
+        {
+            kfree((i64)req->data);
+
+            // Keep arrival order
+            for(i64 j = i; j < queue->num_reqs - 1; j++)
+            {
+                queue->reqs[j] = queue->reqs[j + 1];
+            }
+            queue->num_reqs--;
+
+            continue;
+        }
+
+        // Partial overlap, pending write must land first
+        if(blk_overlaps(req, sector, num_sectors))
+        {
+            if(!blk_dispatch(queue))
+                return false;
+            break;
+        }
+
+        i++;
+    }
+
+    return virtio_block_dev_write_zeroes(queue->dev, sector, num_sectors, unmap);
+}
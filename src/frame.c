@@ -0,0 +1,520 @@
+#include <vga.h>
+#include <frame.h>
+#include <intr.h>
+
+struct page *frame_map = NULL;
+u64 frame_map_len = 0;
+
+static struct frame_zone frame_zones[NUMA_MAX_NODES];
+
+u64 frame_map_size(u64 num_frames)
+{
+    return align(num_frames * sizeof(struct page), FRAME_SIZE);
+}
+
+static void frame_list_push(struct frame_zone *zone, u64 pfn, u64 order)
+{
+    struct page *page = &frame_map[pfn];
+
+    page->order = order;
+    page->flags = FRAME_FREE;
+    page->prev = FRAME_NONE;
+    page->next = zone->free_lists[order];
+
+    if(page->next != FRAME_NONE)
+        frame_map[page->next].prev = pfn;
+
+    zone->free_lists[order] = pfn;
+    zone->free_blocks[order]++;
+}
+
+static void frame_list_remove(struct frame_zone *zone, u64 pfn)
+{
+    struct page *page = &frame_map[pfn];
+
+    if(page->prev != FRAME_NONE)
+        frame_map[page->prev].next = page->next;
+    else
+        zone->free_lists[page->order] = page->next;
+
+    if(page->next != FRAME_NONE)
+        frame_map[page->next].prev = page->prev;
+
+    page->flags &= ~FRAME_FREE;
+    zone->free_blocks[page->order]--;
+}
+
+static i64 __frame_alloc(struct frame_zone *zone, u64 order)
+{
+    // Smallest free block which is big enough
+    u64 i = order;
+    while(i < FRAME_MAX_ORDER && zone->free_lists[i] == FRAME_NONE)
+    {
+        i++;
+    }
+
+    if(i >= FRAME_MAX_ORDER)
+    {
+        // Out of memory
+        return -1;
+    }
+
+    u64 pfn = zone->free_lists[i];
+    frame_list_remove(zone, pfn);
+
+    // Give back upper halves until the block has the requested size
+    while(i > order)
+    {
+        i--;
+        frame_list_push(zone, pfn + (1ULL << i), i);
+    }
+
+    frame_map[pfn].order = order;
+    frame_map[pfn].flags = FRAME_ALLOC;
+    frame_map[pfn].refcount = 1;
+
+    zone->free_frames -= 1ULL << order;
+    zone->min_free = min(zone->min_free, zone->free_frames);
+    zone->allocs++;
+
+    return FRAME_ADDR(pfn);
+}
+
+static void __frame_free(struct frame_zone *zone, u64 pfn, u64 order)
+{
+    zone->free_frames += 1ULL << order;
+
+    frame_map[pfn].flags = 0;
+    frame_map[pfn].refcount = 0;
+
+    // Merge with buddies as long as they are free and of the same size
+    while(order < FRAME_MAX_ORDER - 1)
+    {
+        u64 buddy = pfn ^ (1ULL << order);
+
+        if(buddy >= frame_map_len)
+            break;
+
+        // Blocks never span zones
+        if(!(frame_map[buddy].flags & FRAME_FREE) || frame_map[buddy].order != order ||
+           frame_map[buddy].node != frame_map[pfn].node)
+            break;
+
+        frame_list_remove(zone, buddy);
+
+        pfn = min(pfn, buddy);
+        order++;
+    }
+
+    frame_list_push(zone, pfn, order);
+}
+
+/*
+ * Gives the zeroed blocks back to the zone, returns false if the pools were empty
+ */
+static bool frame_zero_release(struct frame_zone *zone)
+{
+    bool ret = false;
+
+    for(u64 i = 0; i < FRAME_ZERO_ORDERS; i++)
+    {
+        while(zone->zero_count[i] > 0)
+        {
+            __frame_free(zone, zone->zero_pool[i][--zone->zero_count[i]], i);
+            ret = true;
+        }
+    }
+
+    return ret;
+}
+
+void frame_init(struct page *map, u64 num_frames)
+{
+    frame_map = map;
+    frame_map_len = num_frames;
+
+    for(u64 i = 0; i < num_frames; i++)
+    {
+        bzero((u8*)&map[i], sizeof(struct page));
+        map[i].flags = FRAME_RESERVED;
+    }
+
+    for(u64 n = 0; n < NUMA_MAX_NODES; n++)
+    {
+        struct frame_zone *zone = &frame_zones[n];
+
+        bzero((u8*)zone, sizeof(struct frame_zone));
+
+        // Empty until ranges are added
+        zone->start_pfn = num_frames;
+        zone->end_pfn = 0;
+
+        for(u64 i = 0; i < FRAME_MAX_ORDER; i++)
+        {
+            zone->free_lists[i] = FRAME_NONE;
+        }
+    }
+}
+
+/*
+ * Adds a range which lies completely in one node
+ */
+static void frame_add_node_range(u8 node, u64 pfn, u64 end_pfn)
+{
+    struct frame_zone *zone = &frame_zones[node];
+
+    u64 flags = intr_save();
+    mutex_lock(&zone->lock);
+
+    zone->start_pfn = min(zone->start_pfn, pfn);
+    zone->end_pfn = max(zone->end_pfn, end_pfn);
+
+    while(pfn < end_pfn)
+    {
+        // Biggest naturally aligned block starting here
+        u64 order = pfn ? __builtin_ctzll(pfn) : FRAME_MAX_ORDER - 1;
+        order = min(order, FRAME_MAX_ORDER - 1);
+
+        while(pfn + (1ULL << order) > end_pfn)
+        {
+            order--;
+        }
+
+        // Tail frames of the block are no longer reserved
+        for(u64 i = 0; i < (1ULL << order); i++)
+        {
+            frame_map[pfn + i].flags = 0;
+            frame_map[pfn + i].node = node;
+        }
+
+        __frame_free(zone, pfn, order);
+
+        pfn += 1ULL << order;
+    }
+
+    // Added memory isn't a sign of pressure
+    zone->min_free = zone->free_frames;
+
+    mutex_unlock(&zone->lock);
+    intr_restore(flags);
+}
+
+void frame_add_range(u64 start, u64 end)
+{
+    u64 pfn = FRAME_PFN(align(start, FRAME_SIZE));
+    u64 end_pfn = min(FRAME_PFN(end), frame_map_len);
+
+    // Split at node boundaries
+    while(pfn < end_pfn)
+    {
+        u64 node_end;
+        u8 node = numa_memory_node(FRAME_ADDR(pfn), &node_end);
+
+        u64 piece_end = min(end_pfn, FRAME_PFN(node_end));
+
+        // Node range ends inside this frame
+        if(piece_end <= pfn)
+        {
+            pfn++;
+            continue;
+        }
+
+        frame_add_node_range(node, pfn, piece_end);
+
+        pfn = piece_end;
+    }
+}
+
+i64 frame_alloc_node(u8 node, u64 order)
+{
+    if(order >= FRAME_MAX_ORDER || node >= NUMA_MAX_NODES)
+        return -1;
+
+    struct frame_zone *zone = &frame_zones[node];
+
+    u64 flags = intr_save();
+    mutex_lock(&zone->lock);
+
+    i64 ret = __frame_alloc(zone, order);
+
+    // Zeroed blocks are cheaper to lose than a failed allocation
+    if(ret == -1 && frame_zero_release(zone))
+        ret = __frame_alloc(zone, order);
+
+    mutex_unlock(&zone->lock);
+    intr_restore(flags);
+
+    return ret;
+}
+
+i64 frame_alloc(u64 order)
+{
+    u8 *fallback = numa_fallback(numa_local_node());
+
+    for(u64 i = 0; i < numa_num_nodes(); i++)
+    {
+        i64 ret = frame_alloc_node(fallback[i], order);
+        if(ret != -1)
+            return ret;
+    }
+
+    return -1;
+}
+
+bool frame_free(u64 addr)
+{
+    u64 pfn = FRAME_PFN(addr);
+
+    if(pfn >= frame_map_len || (addr & (FRAME_SIZE - 1)) != 0)
+        return false;
+
+    struct frame_zone *zone = &frame_zones[frame_map[pfn].node];
+
+    u64 flags = intr_save();
+    mutex_lock(&zone->lock);
+
+    bool ret = (frame_map[pfn].flags & FRAME_ALLOC) != 0;
+
+    // Ignore double frees
+    if(ret && (frame_map[pfn].flags & FRAME_POOLED))
+    {
+        // Back to the huge page reserve
+        frame_map[pfn].flags = FRAME_POOLED;
+        frame_map[pfn].refcount = 0;
+        zone->huge_pool[zone->huge_count++] = pfn;
+        zone->frees++;
+    }
+    else if(ret)
+    {
+        __frame_free(zone, pfn, frame_map[pfn].order);
+        zone->frees++;
+    }
+
+    mutex_unlock(&zone->lock);
+    intr_restore(flags);
+
+    return ret;
+}
+
+void frame_get(u64 addr)
+{
+    struct page *page = frame_page(addr);
+
+    if(page != NULL)
+        __atomic_fetch_add(&page->refcount, 1, __ATOMIC_SEQ_CST);
+}
+
+bool frame_put(u64 addr)
+{
+    struct page *page = frame_page(addr);
+
+    if(page == NULL)
+        return false;
+
+    if(__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST) != 0)
+        return false;
+
+    return frame_free(addr);
+}
+
+i64 frame_alloc_2m()
+{
+    return frame_alloc(FRAME_ORDER_2M);
+}
+
+i64 frame_alloc_1g()
+{
+    u8 *fallback = numa_fallback(numa_local_node());
+
+    for(u64 i = 0; i < numa_num_nodes(); i++)
+    {
+        struct frame_zone *zone = &frame_zones[fallback[i]];
+
+        u64 flags = intr_save();
+        mutex_lock(&zone->lock);
+
+        i64 ret = -1;
+
+        if(zone->huge_count > 0)
+        {
+            u64 pfn = zone->huge_pool[--zone->huge_count];
+
+            frame_map[pfn].flags = FRAME_ALLOC | FRAME_POOLED;
+            frame_map[pfn].refcount = 1;
+            zone->allocs++;
+
+            ret = FRAME_ADDR(pfn);
+        }
+        else
+        {
+            ret = __frame_alloc(zone, FRAME_ORDER_1G);
+        }
+
+        mutex_unlock(&zone->lock);
+        intr_restore(flags);
+
+        if(ret != -1)
+            return ret;
+    }
+
+    return -1;
+}
+
+u64 frame_reserve_1g(u8 node, u64 count)
+{
+    if(node >= NUMA_MAX_NODES)
+        return 0;
+
+    struct frame_zone *zone = &frame_zones[node];
+
+    u64 flags = intr_save();
+    mutex_lock(&zone->lock);
+
+    u64 reserved = 0;
+
+    while(reserved < count && zone->huge_reserved < FRAME_HUGE_POOL)
+    {
+        i64 addr = __frame_alloc(zone, FRAME_ORDER_1G);
+        if(addr == -1)
+            break;
+
+        u64 pfn = FRAME_PFN(addr);
+
+        frame_map[pfn].flags = FRAME_POOLED;
+        frame_map[pfn].refcount = 0;
+
+        zone->huge_pool[zone->huge_count++] = pfn;
+        zone->huge_reserved++;
+        reserved++;
+    }
+
+    mutex_unlock(&zone->lock);
+    intr_restore(flags);
+
+    return reserved;
+}
+
+i64 frame_zalloc(u64 order)
+{
+    i64 ret = -1;
+
+    if(order < FRAME_ZERO_ORDERS)
+    {
+        struct frame_zone *zone = &frame_zones[numa_local_node()];
+
+        u64 flags = intr_save();
+        mutex_lock(&zone->lock);
+
+        if(zone->zero_count[order] > 0)
+            ret = FRAME_ADDR(zone->zero_pool[order][--zone->zero_count[order]]);
+
+        mutex_unlock(&zone->lock);
+        intr_restore(flags);
+    }
+
+    // Pool is empty, zero it ourselves
+    if(ret == -1)
+    {
+        ret = frame_alloc(order);
+        if(ret != -1)
+            bzero((u8*)ret, FRAME_SIZE << order);
+    }
+
+    return ret;
+}
+
+bool frame_zero_refill()
+{
+    // Nodes nearest to the executing cpu first
+    u8 *fallback = numa_fallback(numa_local_node());
+
+    for(u64 i = 0; i < numa_num_nodes(); i++)
+    {
+        u8 node = fallback[i];
+        struct frame_zone *zone = &frame_zones[node];
+
+        if(zone->free_frames < FRAME_ZERO_MIN_FREE)
+            continue;
+
+        for(u64 order = 0; order < FRAME_ZERO_ORDERS; order++)
+        {
+            // Unlocked check, a stale value only costs one extra block
+            if(zone->zero_count[order] == FRAME_ZERO_POOL)
+                continue;
+
+            i64 addr = frame_alloc_node(node, order);
+            if(addr == -1)
+                break;
+
+            // Zero without holding the zone lock
+            bzero((u8*)addr, FRAME_SIZE << order);
+
+            u64 flags = intr_save();
+            mutex_lock(&zone->lock);
+
+            if(zone->zero_count[order] < FRAME_ZERO_POOL)
+                zone->zero_pool[order][zone->zero_count[order]++] = FRAME_PFN(addr);
+            else
+                __frame_free(zone, FRAME_PFN(addr), order);
+
+            mutex_unlock(&zone->lock);
+            intr_restore(flags);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+struct page* frame_page(u64 addr)
+{
+    u64 pfn = FRAME_PFN(addr);
+
+    if(pfn >= frame_map_len)
+        return NULL;
+
+    return &frame_map[pfn];
+}
+
+u64 frame_free_count()
+{
+    u64 count = 0;
+
+    for(u64 n = 0; n < NUMA_MAX_NODES; n++)
+    {
+        count += frame_zones[n].free_frames;
+    }
+
+    return count;
+}
+
+u64 frame_node_free_count(u8 node)
+{
+    return frame_zones[node].free_frames;
+}
+
+void frame_dump_stats(u8 node)
+{
+    struct frame_zone *zone = &frame_zones[node];
+
+    kprintf("Node %u frames free: %u (low %u), allocs %u, frees %u\n",
+            node, zone->free_frames, zone->min_free, zone->allocs, zone->frees);
+
+    kprintf("Node %u free blocks:", node);
+    for(u64 i = 0; i < FRAME_MAX_ORDER; i++)
+    {
+        if(zone->free_blocks[i] != 0)
+            kprintf(" %u:%u", i, zone->free_blocks[i]);
+    }
+    kprintf("\n");
+
+    kprintf("Node %u 1 GiB reserve: %u of %u free\n", node, zone->huge_count, zone->huge_reserved);
+
+    kprintf("Node %u zeroed blocks:", node);
+    for(u64 i = 0; i < FRAME_ZERO_ORDERS; i++)
+    {
+        kprintf(" %u:%u", i, zone->zero_count[i]);
+    }
+    kprintf("\n");
+}
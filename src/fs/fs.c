@@ -1,8 +1,5 @@
 #include <fs/fs.h>
 
-// Block cache to save stack space
-static u8 tmp[FS_BLOCK_SIZE];
-
 /**
  * Writes sectors to disk
  *
@@ -20,7 +17,7 @@ bool fs_write_sectors(struct fs *fs, i64 index, u8 *data, i64 len)
         return false;
     }
     // Work
-    return virtio_block_dev_write(fs->blk_dev, index, data, len); 
+    return blk_write(&fs->queue, index, data, len); 
 }
 
 /**
@@ -42,6 +39,32 @@ bool fs_write(struct fs *fs, i64 index, u8 *data)
     return fs_write_many(fs, index, data, 1);
 }
 
+/**
+ * Zeros multiple fs blocks on disk without transferring data
+ *
+ * @param index Position on disk where index marks the (index)th fs block
+ * @param len Length in fs blocks
+ * @param unmap Blocks are unused and may be deallocated by the host
+ */
+bool fs_zero_many(struct fs *fs, i64 index, i64 len, bool unmap)
+{
+    // Bounds check
+    if(index < 0 || len <= 0 || ((index + len) * FS_BLOCK_SIZE) > fs->sb_cache.disk_size)
+    {
+        return false;
+    }
+    // Work
+    return blk_write_zeroes(&fs->queue, index * FS_FACTOR, len * FS_FACTOR, unmap);
+}
+
+/**
+ * Zeros single fs block on disk
+ */
+bool fs_zero(struct fs *fs, i64 index)
+{
+    return fs_zero_many(fs, index, 1, false);
+}
+
 /**
  * Reads sectors from disk
  *
@@ -59,7 +82,7 @@ bool fs_read_sectors(struct fs *fs, i64 index, u8* data, i64 len)
         return false;
     }
     // Work
-    return virtio_block_dev_read(fs->blk_dev, index, data, len);
+    return blk_read(&fs->queue, index, data, len);
 }
 
 /**
@@ -81,6 +104,15 @@ bool fs_read(struct fs *fs, i64 index, u8 *data)
     return fs_read_many(fs, index, data, 1);
 }
 
+/**
+ * Commit point: flushes the device's write cache
+ * so that everything written so far survives power loss
+ */
+static bool __fs_sync(struct fs *fs)
+{
+    return blk_flush(&fs->queue);
+}
+
 /**
  * Allocate fs block
  *
@@ -92,13 +124,13 @@ i64 fs_alloc(struct fs *fs)
     bool r;
 
     // Local pointer to tmp
-    i64 *loc = (i64*)&tmp;
+    i64 *loc = (i64*)fs->tmp;
 
     // Iterate over bitmap
     for(i64 i = 0; i < (fs->sb_cache.bitmap_size / FS_BLOCK_SIZE); i++)
     {
         // Read bitmap block
-        r = fs_read(fs, 1 + i, tmp);    // Skip superblock
+        r = fs_read(fs, 1 + i, fs->tmp);    // Skip superblock
         if(!r)
             return false;
 
@@ -122,7 +154,7 @@ i64 fs_alloc(struct fs *fs)
             loc[j] |= (((i64)1) << pos);
 
             // Write back
-            r = fs_write(fs, 1 + i, tmp);
+            r = fs_write(fs, 1 + i, fs->tmp);
             if(!r)
                 return false;
 
@@ -155,25 +187,25 @@ i64 fs_free(struct fs *fs, i64 index)
     i64 pos   = ind % 64;
 
     // Load block
-    r = fs_read(fs, block + 1, (u8*)&tmp);    
+    r = fs_read(fs, block + 1, fs->tmp);    
     // Error check
     if(!r)
         return FS_ERROR;
 
     // Mark as free again
-    i64 *loc = (i64*)&tmp; 
+    i64 *loc = (i64*)fs->tmp; 
     loc[word] = loc[word] & ~(((i64)1) << pos);
     
     // Write back
-    r = fs_write(fs, block + 1, (u8*)&tmp);
+    r = fs_write(fs, block + 1, fs->tmp);
     // Error check
     if(!r)
         return FS_ERROR;
 
     // Zero out block to prevent data leaks and  
     // keep blocks clean when allocated to be pointer blocks
-    bzero((u8*)&tmp, FS_BLOCK_SIZE);
-    r = fs_write(fs, index, (u8*)&tmp);
+    // (offloaded to the device, which may also deallocate it)
+    r = fs_zero_many(fs, index, 1, true);
     if(!r)
         return FS_ERROR;
 
@@ -196,7 +228,7 @@ i64 __fs_inode_alloc(struct fs *fs, struct inode *inode, i64 block_index)
     i64 off, stub, next;
 
     // Local pointer
-    i64 *loc = (i64*)&tmp;  
+    i64 *loc = (i64*)fs->tmp;  
 
     // Current block index
     i64 bx = inode->data_tree;
@@ -205,7 +237,7 @@ i64 __fs_inode_alloc(struct fs *fs, struct inode *inode, i64 block_index)
     for(i64 i = 0; i < 4; i++)
     {
         // Load current layer block
-        fs_read(fs, bx, (u8*)&tmp);
+        fs_read(fs, bx, fs->tmp);
 
         // Get pointer to next layer
         off = shift * (3 - i);
@@ -219,14 +251,13 @@ i64 __fs_inode_alloc(struct fs *fs, struct inode *inode, i64 block_index)
             if(next == FS_ERROR)
                 return FS_ERROR;
             // Reload block since fs_alloc modifies tmp
-            fs_read(fs, bx, (u8*)&tmp);
+            fs_read(fs, bx, fs->tmp);
             // Write newly allocated block into tree
             loc[stub] = next;
             // Write back layer block to disk
-            fs_write(fs, bx, (u8*)&tmp);
+            fs_write(fs, bx, fs->tmp);
             // Zero out new block
-            bzero((u8*)&tmp, FS_BLOCK_SIZE);
-            fs_write(fs, next, (u8*)&tmp);         
+            fs_zero(fs, next);
         }
 
         // Continue with next layer
@@ -245,23 +276,22 @@ i64 __fs_inode_alloc(struct fs *fs, struct inode *inode, i64 block_index)
 i64 fs_inode_alloc(struct fs *fs, i64 inode_index, i64 block_index)
 {
     // Pointer to inode
-    struct inode *inode = (struct inode*)&tmp;
+    struct inode *inode = (struct inode*)fs->tmp;
     // Read inode from disk
-    fs_read(fs, inode_index, (u8*)&tmp);
+    fs_read(fs, inode_index, fs->tmp);
     // Check if there are already allocated blocks
     if(inode->data_tree == 0)
     {
         // Allocate new block
         i64 n = fs_alloc(fs);
         // Clear new block
-        bzero((u8*)&tmp, FS_BLOCK_SIZE);
-        fs_write(fs, n, (u8*)&tmp);
+        fs_zero(fs, n);
         // Reload inode
-        fs_read(fs, inode_index, (u8*)&tmp);
+        fs_read(fs, inode_index, fs->tmp);
         // Set new tree root
         inode->data_tree = n;
         // Write back inode
-        fs_write(fs, inode_index, (u8*)&tmp);
+        fs_write(fs, inode_index, fs->tmp);
     }
     // Do allocation
     return __fs_inode_alloc(fs, inode, block_index);
@@ -296,7 +326,7 @@ i64 __fs_inode_free(struct fs *fs, i64 inode_data_tree, i64 inode_index, i64 blo
     i64 off, next, trace[4], stubs[4];  
 
     // Local pointer
-    i64 *loc = (i64*)&tmp;  
+    i64 *loc = (i64*)fs->tmp;  
 
     // Current block index
     i64 bx = inode_data_tree;
@@ -305,7 +335,7 @@ i64 __fs_inode_free(struct fs *fs, i64 inode_data_tree, i64 inode_index, i64 blo
     for(i64 i = 0; i < 4; i++)
     {
         // Load current layer block
-        fs_read(fs, bx, (u8*)&tmp);
+        fs_read(fs, bx, fs->tmp);
 
         // Save traversed blocks in trace array 
         trace[i] = bx;
@@ -329,7 +359,7 @@ i64 __fs_inode_free(struct fs *fs, i64 inode_data_tree, i64 inode_index, i64 blo
     // Remove from inode
     loc[stubs[3]] = 0;
     // And write changes to disk
-    fs_write(fs, trace[3], (u8*)&tmp);
+    fs_write(fs, trace[3], fs->tmp);
     // Mark block as free 
     fs_free(fs, bx); 
 
@@ -342,7 +372,7 @@ i64 __fs_inode_free(struct fs *fs, i64 inode_data_tree, i64 inode_index, i64 blo
     // Write 0 to inode's data tree or to highest level block which has not be freed
    
     // Reload block polluted by fs_free
-    fs_read(fs, trace[3], (u8*)&tmp);
+    fs_read(fs, trace[3], fs->tmp);
 
     for(i64 i = 3; i > 0; i--)
     {
@@ -352,11 +382,11 @@ i64 __fs_inode_free(struct fs *fs, i64 inode_data_tree, i64 inode_index, i64 blo
             // Mark block as free again
             fs_free(fs, trace[i]);
             // Read higher level block
-            fs_read(fs, trace[i-1], (u8*)&tmp);
+            fs_read(fs, trace[i-1], fs->tmp);
             // Mark entry for lower level block as zero
             loc[stubs[i-1]] = 0;
             // Write back to disk
-            fs_write(fs, trace[i-1], (u8*)&tmp);
+            fs_write(fs, trace[i-1], fs->tmp);
         }
         else
         {
@@ -366,19 +396,19 @@ i64 __fs_inode_free(struct fs *fs, i64 inode_data_tree, i64 inode_index, i64 blo
     }
 
     // Check highest level block
-    struct inode *inode = (struct inode*)&tmp;
+    struct inode *inode = (struct inode*)fs->tmp;
     if(__fs_block_all_zeros(loc))
     {
         // Load inode
-        fs_read(fs, inode_index, (u8*)&tmp);
+        fs_read(fs, inode_index, fs->tmp);
         // Mark block as free
         fs_free(fs, inode->data_tree);
         // Reload (by fs_free) polluted block
-        fs_read(fs, inode_index, (u8*)&tmp);
+        fs_read(fs, inode_index, fs->tmp);
         // Free
         inode->data_tree = 0;
         // Write back to disk
-        fs_write(fs, inode_index, (u8*)&tmp);
+        fs_write(fs, inode_index, fs->tmp);
     }
 
 __fs_inode_free_end:
@@ -389,9 +419,9 @@ __fs_inode_free_end:
 i64 fs_inode_free(struct fs *fs, i64 inode_index, i64 block_index)
 {
     // Pointer to inode
-    struct inode *inode = (struct inode*)&tmp;
+    struct inode *inode = (struct inode*)fs->tmp;
     // Read inode from disk
-    fs_read(fs, inode_index, (u8*)&tmp);
+    fs_read(fs, inode_index, fs->tmp);
     // Check if data was already allocated
     if(inode->data_tree == 0)
         return FS_ERROR;
@@ -414,13 +444,13 @@ i64 fs_inode_resize(struct fs *fs, i64 inode_index, i64 size)
         return FS_ERROR;
     
     // Read inode from disk
-    bool b = fs_read(fs, inode_index, (u8*)&tmp);
+    bool b = fs_read(fs, inode_index, fs->tmp);
     // Err check
     if(!b)
         return FS_ERROR;
 
     // Pointer to inode
-    struct inode *inode = (struct inode*)&tmp;
+    struct inode *inode = (struct inode*)fs->tmp;
 
     // Allready allocated blocks
     i64 aab = inode->file_size / FS_BLOCK_SIZE;
@@ -462,9 +492,9 @@ i64 fs_inode_resize(struct fs *fs, i64 inode_index, i64 size)
     }
     
     // Write back new size
-    fs_read(fs, inode_index, (u8*)&tmp);
+    fs_read(fs, inode_index, fs->tmp);
     inode->file_size = size;
-    fs_write(fs, inode_index, (u8*)&tmp);
+    fs_write(fs, inode_index, fs->tmp);
 
     // If no errors then return new size
     return size;
@@ -486,11 +516,11 @@ i64 fs_inode_nth_block(struct fs *fs, i64 inode_index, i64 n)
     i64 off, stub, next;
 
     // Local pointer
-    i64 *loc = (i64*)&tmp;  
-    struct inode *inode = (struct inode*)&tmp;
+    i64 *loc = (i64*)fs->tmp;  
+    struct inode *inode = (struct inode*)fs->tmp;
 
     // Load inode
-    fs_read(fs, inode_index, (u8*)tmp);
+    fs_read(fs, inode_index, fs->tmp);
 
     // Current block index
     i64 bx = inode->data_tree;
@@ -499,7 +529,7 @@ i64 fs_inode_nth_block(struct fs *fs, i64 inode_index, i64 n)
     for(i64 i = 0; i < 4; i++)
     {
         // Load current layer block
-        fs_read(fs, bx, (u8*)&tmp);
+        fs_read(fs, bx, fs->tmp);
 
         // Get pointer to next layer
         off = shift * (3 - i);
@@ -569,8 +599,8 @@ static void __fs_strcpy(char *dst, char *src)
 i64 fs_inode_add_entry(struct fs *fs, i64 inode_index, char *name)
 {
      // Load inode
-    struct inode *inode = (struct inode*)&tmp;    
-    fs_read(fs, inode_index, (u8*)&tmp);
+    struct inode *inode = (struct inode*)fs->tmp;    
+    fs_read(fs, inode_index, fs->tmp);
         
     // Check if inode is a directory
     if(inode->type != FS_TYPE_DIRECTORY)
@@ -592,7 +622,7 @@ i64 fs_inode_add_entry(struct fs *fs, i64 inode_index, char *name)
     i64 nb = fs_alloc(fs);
 
     // Pointer to entries
-    struct dir_entry *entries = (struct dir_entry*)&tmp;
+    struct dir_entry *entries = (struct dir_entry*)fs->tmp;
 
     // Read block by block 
     for(i64 i = 0; i < trav; i++)
@@ -602,7 +632,7 @@ i64 fs_inode_add_entry(struct fs *fs, i64 inode_index, char *name)
             return FS_ERROR;
         
         // Read nth block
-        fs_read(fs, r, (u8*)&tmp);
+        fs_read(fs, r, fs->tmp);
         
         // Check that name does not already exists
         for(i64 j = 0; j < (FS_BLOCK_SIZE / (i64)sizeof(struct dir_entry)); j++)
@@ -628,12 +658,12 @@ i64 fs_inode_add_entry(struct fs *fs, i64 inode_index, char *name)
                     entries[j].inode_index = nb;
                     __fs_strcpy(entries[j].file_name, name);
                     // Write back to disk
-                    fs_write(fs, r, (u8*)&tmp);
+                    fs_write(fs, r, fs->tmp);
                     
                     // Increase inode num_entries counter
-                    fs_read(fs, inode_index, (u8*)&tmp);
+                    fs_read(fs, inode_index, fs->tmp);
                     inode->num_entries++;
-                    fs_write(fs, inode_index, (u8*)&tmp);
+                    fs_write(fs, inode_index, fs->tmp);
 
                     return nb;
                 }  
@@ -657,19 +687,19 @@ i64 fs_inode_add_entry(struct fs *fs, i64 inode_index, char *name)
         return FS_ERROR;
 
     // Clear tmp
-    bzero((u8*)&tmp, FS_BLOCK_SIZE);
+    bzero(fs->tmp, FS_BLOCK_SIZE);
 
     // Insert entry
     entries[0].inode_index = nb;
     __fs_strcpy((char*)&entries[0].file_name, name);
     
     // Write to disk
-    fs_write(fs, next_block_index, (u8*)&tmp);
+    fs_write(fs, next_block_index, fs->tmp);
 
     // Increase inode num_entries counter
-    fs_read(fs, inode_index, (u8*)&tmp);
+    fs_read(fs, inode_index, fs->tmp);
     inode->num_entries++;
-    fs_write(fs, inode_index, (u8*)&tmp);
+    fs_write(fs, inode_index, fs->tmp);
 
     // Entry not found
     return nb;
@@ -685,8 +715,8 @@ i64 fs_inode_add_entry(struct fs *fs, i64 inode_index, char *name)
 i64 fs_inode_del_entry(struct fs *fs, i64 inode_index, char *name)
 {
      // Load inode
-    struct inode *inode = (struct inode*)&tmp;    
-    fs_read(fs, inode_index, (u8*)&tmp);
+    struct inode *inode = (struct inode*)fs->tmp;    
+    fs_read(fs, inode_index, fs->tmp);
         
     // Check if inode is a directory
     if(inode->type != FS_TYPE_DIRECTORY)
@@ -707,10 +737,10 @@ i64 fs_inode_del_entry(struct fs *fs, i64 inode_index, char *name)
             return FS_ERROR;
         
         // Read nth block
-        fs_read(fs, r, (u8*)&tmp);
+        fs_read(fs, r, fs->tmp);
 
         // Search in block for name
-        struct dir_entry *entries = (struct dir_entry*)&tmp;
+        struct dir_entry *entries = (struct dir_entry*)fs->tmp;
         for(i64 j = 0; j < (FS_BLOCK_SIZE / (i64)sizeof(struct dir_entry)); j++)
         {
             // Stop traversing when all entries are read
@@ -725,15 +755,15 @@ i64 fs_inode_del_entry(struct fs *fs, i64 inode_index, char *name)
                 fs_inode_resize(fs, iitbd, 0);
                 fs_free(fs, iitbd);                 
                 // Read back polluted block
-                fs_read(fs, r, (u8*)&tmp);
+                fs_read(fs, r, fs->tmp);
                 // Remove entry
                 entries[j].inode_index = 0;
                 bzero((u8*)&entries[j], FS_NAME_LEN);
                 // Write back
-                fs_write(fs, r, (u8*)&tmp);
+                fs_write(fs, r, fs->tmp);
                 // Check if resize is needed
                 // Get last block and check for entries
-                fs_read(fs, trav-1, (u8*)&tmp);
+                fs_read(fs, trav-1, fs->tmp);
                 for(i64 k = 0; k < (FS_BLOCK_SIZE / (i64)sizeof(struct dir_entry)); k++)
                 {
                     if(entries[k].inode_index != 0)
@@ -742,7 +772,7 @@ i64 fs_inode_del_entry(struct fs *fs, i64 inode_index, char *name)
                     }
                 }   
                 // Free last block
-                fs_read(fs, inode_index, (u8*)&tmp);
+                fs_read(fs, inode_index, fs->tmp);
                 fs_inode_resize(fs, inode_index, inode->file_size - FS_BLOCK_SIZE);
 
                 return 0;
@@ -766,8 +796,8 @@ i64 fs_inode_del_entry(struct fs *fs, i64 inode_index, char *name)
 i64 fs_inode_query_name(struct fs *fs, i64 inode_index, char* name)
 {
     // Load inode
-    struct inode *inode = (struct inode*)&tmp;    
-    fs_read(fs, inode_index, (u8*)&tmp);
+    struct inode *inode = (struct inode*)fs->tmp;    
+    fs_read(fs, inode_index, fs->tmp);
         
     // Check if inode is a directory
     if(inode->type != FS_TYPE_DIRECTORY)
@@ -788,10 +818,10 @@ i64 fs_inode_query_name(struct fs *fs, i64 inode_index, char* name)
             return FS_ERROR;
         
         // Read nth block
-        fs_read(fs, r, (u8*)&tmp);
+        fs_read(fs, r, fs->tmp);
 
         // Search in block for name
-        struct dir_entry *entries = (struct dir_entry*)&tmp;
+        struct dir_entry *entries = (struct dir_entry*)fs->tmp;
         for(i64 j = 0; j < (FS_BLOCK_SIZE / (i64)sizeof(struct dir_entry)); j++)
         {
             // Stop traversing when all entries are read
@@ -927,6 +957,18 @@ static i64 __bitmap_size(i64 disk_size, i64 block_size)
 bool fs_init(struct fs *fs, virtio_blk_dev_t *blk_dev, bool fresh)
 {
     fs->blk_dev = blk_dev;
+    mutex_init(&fs->lock);
+
+    // fs blocks must consist of whole device blocks, 
+    // otherwise every block write becomes a read-modify-write
+    if((FS_BLOCK_SIZE % blk_dev->blk_size) != 0 || 
+       (FS_BLOCK_SIZE % blk_dev->phys_blk_size) != 0)
+    {
+        return false;
+    }
+
+    if(!blk_queue_init(&fs->queue, blk_dev))
+        return false;
 
     if(fresh)
     {
@@ -937,6 +979,9 @@ bool fs_init(struct fs *fs, virtio_blk_dev_t *blk_dev, bool fresh)
         // Write super block to start of the disk
         if(!fs_write(fs, 0, (u8*)&fs->sb_cache))
             return false;
+        // Fresh fs must be durable before it is used
+        if(!__fs_sync(fs))
+            return false;
     }
     else
     {
@@ -951,18 +996,18 @@ bool fs_init(struct fs *fs, virtio_blk_dev_t *blk_dev, bool fresh)
 // Set type (e.g. file/dir)
 static bool fs_type(struct fs *fs, i64 handle, i64 type)
 {
-   struct inode *ptr = (struct inode*)&tmp;
+   struct inode *ptr = (struct inode*)fs->tmp;
    // Read inode
-   fs_read(fs, handle, (u8*)&tmp);
+   fs_read(fs, handle, fs->tmp);
    // Change type
    ptr->type = type;
    // Write back
-   fs_write(fs, handle, (u8*)&tmp);
+   fs_write(fs, handle, fs->tmp);
    
    return true;
 }
 
-bool fs_mk(struct fs *fs, char *path, char *name, i64 type)
+static bool __fs_mk(struct fs *fs, char *path, char *name, i64 type)
 {
     i64 ii = fs_inode_query(fs, path);
     if(ii == FS_ERROR)
@@ -970,11 +1015,14 @@ bool fs_mk(struct fs *fs, char *path, char *name, i64 type)
     i64 ret = fs_inode_add_entry(fs, ii, name);
     if(ret == FS_ERROR)
         return false;
-    // Change type and return
-    return fs_type(fs, ret, type & 1);
+    // Change type
+    if(!fs_type(fs, ret, type & 1))
+        return false;
+    // Commit
+    return __fs_sync(fs);
 }
 
-bool fs_rm(struct fs *fs, char *path, char *name)
+static bool __fs_rm(struct fs *fs, char *path, char *name)
 {
     i64 ii = fs_inode_query(fs, path);
     if(ii == FS_ERROR)
@@ -982,19 +1030,20 @@ bool fs_rm(struct fs *fs, char *path, char *name)
     i64 ret = fs_inode_del_entry(fs, ii, name);
     if(ret == FS_ERROR)
         return false;
-    return true;
+    // Commit
+    return __fs_sync(fs);
 }
 
-i64 fs_handle(struct fs *fs, char *path)
+static i64 __fs_handle(struct fs *fs, char *path)
 {
     return fs_inode_query(fs, path);
 }
 
-bool fs_size(struct fs *fs, i64 handle, i64 *size)
+static bool __fs_size(struct fs *fs, i64 handle, i64 *size)
 {
-    struct inode *ptr = (struct inode*)&tmp;
+    struct inode *ptr = (struct inode*)fs->tmp;
     // Read inode
-    bool err = fs_read(fs, handle, (u8*)&tmp);
+    bool err = fs_read(fs, handle, fs->tmp);
     if(!err)
         return false;
     // Return size 
@@ -1002,26 +1051,26 @@ bool fs_size(struct fs *fs, i64 handle, i64 *size)
     return true;
 }
 
-bool fs_seek(struct fs *fs, i64 handle, i64 off)
+static bool __fs_seek(struct fs *fs, i64 handle, i64 off)
 {
-    struct inode *ptr = (struct inode*)&tmp;
+    struct inode *ptr = (struct inode*)fs->tmp;
     // Read inode
-    fs_read(fs, handle, (u8*)&tmp);
+    fs_read(fs, handle, fs->tmp);
     // Change position
     if(ptr->file_size != 0)
     { 
         ptr->pos = (ptr->pos + off) % ptr->file_size;
         // Write back
-        fs_write(fs, handle, (u8*)&tmp);
+        fs_write(fs, handle, fs->tmp);
     }
     return true;
 }
 
-bool fs_wrfl(struct fs *fs, i64 handle, u8 *data, i64 len)
+static bool __fs_wrfl(struct fs *fs, i64 handle, u8 *data, i64 len)
 {
     // Read inode
-    struct inode *ptr = (struct inode*)&tmp;
-    fs_read(fs, handle, (u8*)&tmp);
+    struct inode *ptr = (struct inode*)fs->tmp;
+    fs_read(fs, handle, fs->tmp);
     
     // Check for file
     if(ptr->type != FS_TYPE_FILE)
@@ -1034,7 +1083,7 @@ bool fs_wrfl(struct fs *fs, i64 handle, u8 *data, i64 len)
     }
 
     // Read back polluted inode
-    fs_read(fs, handle, (u8*)&tmp);
+    fs_read(fs, handle, fs->tmp);
 
     // Read actual data
     const i64 bound = (len % FS_BLOCK_SIZE) == 0 ? 
@@ -1049,11 +1098,11 @@ bool fs_wrfl(struct fs *fs, i64 handle, u8 *data, i64 len)
     {
         // Read current block
         i64 cb = fs_inode_nth_block(fs, handle, block + i);
-        fs_read(fs, cb, (u8*)&tmp);
+        fs_read(fs, cb, fs->tmp);
     
         // Write data to tmp 
         i64 amount = min(len, FS_BLOCK_SIZE - offset);  
-        memcpy((u8*)&tmp + offset, data, amount);
+        memcpy(fs->tmp + offset, data, amount);
 
         written += amount;
 
@@ -1063,20 +1112,21 @@ bool fs_wrfl(struct fs *fs, i64 handle, u8 *data, i64 len)
         offset = 0;
 
         // Write back to disk
-        fs_write(fs, cb, (u8*)&tmp);
+        fs_write(fs, cb, fs->tmp);
     }
 
     // Seek forward
-    fs_seek(fs, handle, written); 
+    __fs_seek(fs, handle, written); 
 
-    return true; 
+    // Commit
+    return __fs_sync(fs); 
 }
 
-bool fs_refl(struct fs *fs, i64 handle, u8 *data, i64 len)
+static bool __fs_refl(struct fs *fs, i64 handle, u8 *data, i64 len)
 {
      // Read inode
-    struct inode *ptr = (struct inode*)&tmp;
-    fs_read(fs, handle, (u8*)&tmp);
+    struct inode *ptr = (struct inode*)fs->tmp;
+    fs_read(fs, handle, fs->tmp);
     
     // Check for file
     if(ptr->type != FS_TYPE_FILE)
@@ -1101,11 +1151,11 @@ bool fs_refl(struct fs *fs, i64 handle, u8 *data, i64 len)
     {
         // Read current block
         i64 cb = fs_inode_nth_block(fs, handle, block + i);
-        fs_read(fs, cb, (u8*)&tmp);
+        fs_read(fs, cb, fs->tmp);
     
         // Read data
         i64 amount = min(len, FS_BLOCK_SIZE - offset);  
-        memcpy(data, (u8*)&tmp + offset, amount);
+        memcpy(data, fs->tmp + offset, amount);
 
         read += amount;
 
@@ -1116,8 +1166,159 @@ bool fs_refl(struct fs *fs, i64 handle, u8 *data, i64 len)
     }
 
     // Seek forward
-    fs_seek(fs, handle, read);
+    __fs_seek(fs, handle, read);
 
     return true;       
 }
 
+static bool __fs_read_page(struct fs *fs, i64 handle, i64 off, u8 *page)
+{
+    // Read inode
+    struct inode *ptr = (struct inode*)fs->tmp;
+    if(!fs_read(fs, handle, fs->tmp))
+        return false;
+
+    // Check for file
+    if(ptr->type != FS_TYPE_FILE || off < 0 || (off % FS_BLOCK_SIZE) != 0)
+        return false;
+
+    i64 size = ptr->file_size;
+
+    // Nothing left of the file
+    if(off >= size)
+    {
+        bzero(page, FS_BLOCK_SIZE);
+        return true;
+    }
+
+    i64 cb = fs_inode_nth_block(fs, handle, off / FS_BLOCK_SIZE);
+    if(cb == FS_ERROR)
+        return false;
+
+    // No copy through tmp
+    if(!fs_read(fs, cb, page))
+        return false;
+
+    // Clear the part behind the end
+    if(size - off < FS_BLOCK_SIZE)
+        bzero(page + (size - off), FS_BLOCK_SIZE - (size - off));
+
+    return true;
+}
+
+static bool __fs_write_page(struct fs *fs, i64 handle, i64 off, u8 *page)
+{
+    // Read inode
+    struct inode *ptr = (struct inode*)fs->tmp;
+    if(!fs_read(fs, handle, fs->tmp))
+        return false;
+
+    // Check for file
+    if(ptr->type != FS_TYPE_FILE || off < 0 || (off % FS_BLOCK_SIZE) != 0)
+        return false;
+
+    // Keep the size
+    if(off >= ptr->file_size)
+        return true;
+
+    i64 cb = fs_inode_nth_block(fs, handle, off / FS_BLOCK_SIZE);
+    if(cb == FS_ERROR)
+        return false;
+
+    // The queue copies the data, no need for tmp
+    return fs_write(fs, cb, page);
+}
+
+/*
+ * Entry points, one call at a time per fs
+ */
+
+bool fs_sync(struct fs *fs)
+{
+    mutex_lock(&fs->lock);
+    bool ret = __fs_sync(fs);
+    mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+bool fs_mk(struct fs *fs, char *path, char *name, i64 type)
+{
+    mutex_lock(&fs->lock);
+    bool ret = __fs_mk(fs, path, name, type);
+    mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+bool fs_rm(struct fs *fs, char *path, char *name)
+{
+    mutex_lock(&fs->lock);
+    bool ret = __fs_rm(fs, path, name);
+    mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+i64 fs_handle(struct fs *fs, char *path)
+{
+    mutex_lock(&fs->lock);
+    i64 ret = __fs_handle(fs, path);
+    mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+bool fs_size(struct fs *fs, i64 handle, i64 *size)
+{
+    mutex_lock(&fs->lock);
+    bool ret = __fs_size(fs, handle, size);
+    mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+bool fs_seek(struct fs *fs, i64 handle, i64 off)
+{
+    mutex_lock(&fs->lock);
+    bool ret = __fs_seek(fs, handle, off);
+    mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+bool fs_wrfl(struct fs *fs, i64 handle, u8 *data, i64 len)
+{
+    mutex_lock(&fs->lock);
+    bool ret = __fs_wrfl(fs, handle, data, len);
+    mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+bool fs_refl(struct fs *fs, i64 handle, u8 *data, i64 len)
+{
+    mutex_lock(&fs->lock);
+    bool ret = __fs_refl(fs, handle, data, len);
+    mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+bool fs_read_page(struct fs *fs, i64 handle, i64 off, u8 *page)
+{
+    mutex_lock(&fs->lock);
+    bool ret = __fs_read_page(fs, handle, off, page);
+    mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+bool fs_write_page(struct fs *fs, i64 handle, i64 off, u8 *page)
+{
+    mutex_lock(&fs->lock);
+    bool ret = __fs_write_page(fs, handle, off, page);
+    mutex_unlock(&fs->lock);
+
+    return ret;
+}
@@ -0,0 +1,229 @@
+#include <intr.h>
+#include <slab.h>
+#include <frame.h>
+#include <fs/pcache.h>
+
+// Pages sorted by file and offset
+static struct ktree pcache_pages = {NULL};
+static struct kmem_cache *pcache_cache = NULL;
+
+// Protects the tree and the counts, io happens without it
+static mutex_t pcache_lock = 0;
+
+static int cmp_pages(struct pcache_page *p0, struct pcache_page *p1)
+{
+    if(p0->fs != p1->fs)
+        return ((u64)p0->fs < (u64)p1->fs) ? -1 : 1;
+    if(p0->handle != p1->handle)
+        return (p0->handle < p1->handle) ? -1 : 1;
+    if(p0->off != p1->off)
+        return (p0->off < p1->off) ? -1 : 1;
+    return 0;
+}
+
+bool pcache_init()
+{
+    pcache_cache = kmem_cache_create("pcache_page", sizeof(struct pcache_page), 0, NULL);
+    return pcache_cache != NULL;
+}
+
+/*
+ * Lock must be held
+ */
+static struct pcache_page* pcache_find(struct fs *fs, i64 handle, i64 off)
+{
+    struct pcache_page query = {.fs = fs, .handle = handle, .off = off};
+    struct ktree_node *node = NULL;
+
+    if(!ktree_find(&pcache_pages, &query, OFFSET(struct pcache_page, tree_handle), (int (*)(void*, void*))cmp_pages, &node))
+        return NULL;
+
+    return (ENCLAVE(struct pcache_page, tree_handle, node));
+}
+
+/*
+ * Drops a reference taken while the page was loading, the last one frees it
+ */
+static void pcache_unref(struct pcache_page *page)
+{
+    u64 flags = intr_save();
+    mutex_lock(&pcache_lock);
+
+    bool last = --page->users == 0;
+
+    mutex_unlock(&pcache_lock);
+    intr_restore(flags);
+
+    if(last)
+        kmem_cache_free(pcache_cache, page);
+}
+
+i64 pcache_get(struct fs *fs, i64 handle, i64 off)
+{
+    if(pcache_cache == NULL)
+        return -1;
+
+    u64 flags = intr_save();
+    mutex_lock(&pcache_lock);
+
+    struct pcache_page *page;
+
+    // The last put is writing the page back, reading the block now would see old data
+    while((page = pcache_find(fs, handle, off)) != NULL && page->users == 0)
+    {
+        mutex_unlock(&pcache_lock);
+        intr_restore(flags);
+
+        __asm__ volatile("pause");
+
+        flags = intr_save();
+        mutex_lock(&pcache_lock);
+    }
+
+    if(page != NULL)
+    {
+        page->users++;
+
+        mutex_unlock(&pcache_lock);
+        intr_restore(flags);
+
+        // Another get is still reading the block
+        while(__atomic_load_n(&page->loading, __ATOMIC_ACQUIRE))
+            __asm__ volatile("pause");
+
+        if(page->frame != (u64)-1)
+            return page->frame;
+
+        // The read failed, the page is out of the tree already
+        pcache_unref(page);
+        return -1;
+    }
+
+    page = kmem_cache_alloc(pcache_cache);
+    i64 frame = (page != NULL) ? frame_alloc(0) : -1;
+
+    if(frame == -1)
+    {
+        mutex_unlock(&pcache_lock);
+        intr_restore(flags);
+
+        if(page != NULL)
+            kmem_cache_free(pcache_cache, page);
+
+        return -1;
+    }
+
+    page->fs = fs;
+    page->handle = handle;
+    page->off = off;
+    page->frame = frame;
+    page->users = 1;
+    page->dirty = false;
+    page->loading = true;
+
+    // Placeholder, gets of the same block wait for the read instead of starting their own
+    ktree_insert(&pcache_pages, &page->tree_handle, OFFSET(struct pcache_page, tree_handle), (int (*)(void*, void*))cmp_pages);
+
+    mutex_unlock(&pcache_lock);
+    intr_restore(flags);
+
+    // Read into the frame which gets mapped, with the caller's interrupt state
+    if(fs_read_page(fs, handle, off, (u8*)frame))
+    {
+        __atomic_store_n(&page->loading, false, __ATOMIC_RELEASE);
+        return frame;
+    }
+
+    flags = intr_save();
+    mutex_lock(&pcache_lock);
+
+    ktree_remove(&pcache_pages, &page->tree_handle);
+
+    // Waiters see the failure and drop their references
+    page->frame = -1;
+    bool last = --page->users == 0;
+    __atomic_store_n(&page->loading, false, __ATOMIC_RELEASE);
+
+    mutex_unlock(&pcache_lock);
+    intr_restore(flags);
+
+    frame_free(frame);
+
+    if(last)
+        kmem_cache_free(pcache_cache, page);
+
+    return -1;
+}
+
+void pcache_put(struct fs *fs, i64 handle, i64 off, bool dirty)
+{
+    u64 flags = intr_save();
+    mutex_lock(&pcache_lock);
+
+    struct pcache_page *page = pcache_find(fs, handle, off);
+    bool last = false;
+
+    if(page != NULL)
+    {
+        page->dirty |= dirty;
+        last = --page->users == 0;
+
+        // Dirty pages stay in the tree until written back, so gets wait for the new data
+        if(last && !page->dirty)
+            ktree_remove(&pcache_pages, &page->tree_handle);
+    }
+
+    mutex_unlock(&pcache_lock);
+    intr_restore(flags);
+
+    if(!last)
+        return;
+
+    if(page->dirty)
+    {
+        // A failed write back loses the changes, just like a failed fs_wrfl
+        fs_write_page(fs, handle, off, (u8*)page->frame);
+
+        flags = intr_save();
+        mutex_lock(&pcache_lock);
+
+        ktree_remove(&pcache_pages, &page->tree_handle);
+
+        mutex_unlock(&pcache_lock);
+        intr_restore(flags);
+    }
+
+    frame_free(page->frame);
+    kmem_cache_free(pcache_cache, page);
+}
+
+bool pcache_flush(struct fs *fs, i64 handle, i64 off)
+{
+    u64 flags = intr_save();
+    mutex_lock(&pcache_lock);
+
+    // Puts during the write mark it dirty again
+    struct pcache_page *page = pcache_find(fs, handle, off);
+    if(page != NULL)
+        page->dirty = false;
+
+    mutex_unlock(&pcache_lock);
+    intr_restore(flags);
+
+    if(page == NULL)
+        return false;
+
+    // The caller's reference keeps the page
+    if(fs_write_page(fs, handle, off, (u8*)page->frame))
+        return true;
+
+    flags = intr_save();
+    mutex_lock(&pcache_lock);
+
+    page->dirty = true;
+
+    mutex_unlock(&pcache_lock);
+    intr_restore(flags);
+
+    return false;
+}
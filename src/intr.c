@@ -1,6 +1,8 @@
 #include <io.h>
 #include <pit.h>
 #include <apic.h>
+#include <tlb.h>
+#include <region.h>
 #include <intr.h>
 
 #define BIT16_MASK 0xffff
@@ -42,6 +44,22 @@ void intr_disable()
     __asm__ volatile("cli");
 }
 
+u64 intr_save()
+{
+    u64 flags;
+    __asm__ volatile("pushfq\n"
+                     "pop %0\n"
+                     "cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+void intr_restore(u64 flags)
+{
+    // Interrupt flag
+    if(flags & (1 << 9))
+        __asm__ volatile("sti" : : : "memory");
+}
+
 static struct interrupt_descriptor_table idt __attribute__((aligned(64)));                 // Alignment for better performance
 static struct interrupt_descriptor_table_descriptor idtr __attribute__((aligned(16)));
 /*
@@ -306,6 +324,11 @@ void intr_setup()
     idt_register(&idtr);
 }
 
+void intr_ap_setup()
+{
+    idt_register(&idtr);
+}
+
 void pic_init()
 {
     u8 icw1  = (1 << 4) | 1; // Initialize & IC4
@@ -368,10 +391,29 @@ void pic_disable()
  * context: saved cpu context
  * code: number of interrupt/exception
 */
-struct cpu_context* intr_handler(struct cpu_context* saved_context, u64 code)
+struct cpu_context* intr_handler(struct cpu_context* saved_context, u64 code, u64 error)
 {
     //kprintf("Interrupt [%d]\n", code);
 
+    // Page fault, map the page lazily if it belongs to a region
+    if(code == INTR_NUM_PF)
+    {
+        u64 addr = rcr2();
+
+        // The interrupt frame follows the saved registers, vector and error code
+        struct interrupt_context *frame = (struct interrupt_context*)((u64*)(saved_context + 1) + 2);
+
+        if(!region_fault(addr, error, (frame->rflags & (1 << 9)) != 0))
+        {
+            kprintf("Page fault at %h (error %h)\n", addr, error);
+
+            while(1)
+            {
+                __asm__ volatile("hlt");
+            }
+        }
+    }
+
     // Handle PIT (timer) interrupt and make pit_delay() work
     if(code == INTR_NUM_PIT)
     {
@@ -379,6 +421,13 @@ struct cpu_context* intr_handler(struct cpu_context* saved_context, u64 code)
         lapic_end_of_int(lapic_fetch());
     }
 
+    // TLB shootdown
+    if(code == INTR_NUM_TLB)
+    {
+        tlb_handle_intr();
+        lapic_end_of_int(lapic_fetch());
+    }
+
     /*
     if(code == 0x21)
     {
@@ -50,6 +50,44 @@ void wmsr(u32 msr, u64 val)
     asm volatile("wrmsr" : : "a"(lo), "d"(hi), "c"(msr));
 }
 
+u64 rcr0()
+{
+    u64 val;
+    asm volatile("mov %%cr0, %0" : "=r"(val));
+    return val;
+}
+
+void wcr0(u64 val)
+{
+    asm volatile("mov %0, %%cr0" : : "r"(val) : "memory");
+}
+
+u64 rcr2()
+{
+    u64 val;
+    asm volatile("mov %%cr2, %0" : "=r"(val));
+    return val;
+}
+
+u64 rcr4()
+{
+    u64 val;
+    asm volatile("mov %%cr4, %0" : "=r"(val));
+    return val;
+}
+
+void wcr4(u64 val)
+{
+    asm volatile("mov %0, %%cr4" : : "r"(val) : "memory");
+}
+
+void cpuid(u32 leaf, u32 subleaf, u32 *regs)
+{
+    asm volatile("cpuid" 
+                 : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3]) 
+                 : "a"(leaf), "c"(subleaf));
+}
+
 void mmio_writeb(size_t addr, u8  val)
 {
     volatile u8 *ptr = (u8*)addr;
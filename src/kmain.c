@@ -5,8 +5,14 @@
 #include <pci.h>
 #include <apic.h>
 #include <intr.h>
+#include <frame.h>
+#include <tlb.h>
+#include <region.h>
+#include <aspace.h>
+#include <vmalloc.h>
 #include <sync.h>
 #include <kernel.h>
+#include <percpu.h>
 #include <syscalls.h>
 #include <user_mode.h>
 
@@ -16,13 +22,13 @@
 #include <multiboot.h>
 
 #include <fs/fs.h>
+#include <fs/pcache.h>
 
-extern struct kheap kernel_heap;
-extern int cmp_chunks(struct kchunk *c0, struct kchunk* c1);
 
 // Linker variables
 extern void kernel_base;
 extern void kernel_limit;
+extern char kernel_stack[];
 const u64 kernel_base_addr  = (u64)&kernel_base;
 const u64 kernel_limit_addr = (u64)&kernel_limit;
 
@@ -41,48 +47,53 @@ void user_func()
 
 void kmain(struct multiboot_information *mb_info)
 {
-    // Setup identity page mapping
-    paging_id_full();
-
-    tss_init();
+    // Per cpu data, GDT and TSS of the boot cpu, needed by everything below
+    if(!percpu_init((u64)kernel_stack))
+        kpanic();
 
     kclear();
     kprintf("Kernel at your service!\n");
 
-    // Init heap
-    kheap_init(&kernel_heap);
-
     kprintf("Multiboot info struct: %u\n", (u64)mb_info);
-    kprintf("Multiboot memory map: %u\n", (u64)multiboot_memmap(mb_info));
 
-    struct multiboot_memory_map* memmap = multiboot_memmap(mb_info);
+    // No execute and global pages for the identity map
+    paging_cpu_init();
+
+    // Bring up physical memory and map all of it, the heap grows from it on demand
+    if(!pmm_init(mb_info))
+    {
+        kprintf("Physical memory setup failed\n");
+        kpanic();
+    }
+
+    // Kernel code read only, everything else not executable
+    if(!paging_protect_kernel())
+    {
+        kprintf("Kernel protection failed\n");
+        kpanic();
+    }
+
+    if(!vmalloc_init())
+    {
+        kprintf("Kernel virtual memory setup failed\n");
+        kpanic();
+    }
 
-    u64 num_entries = multiboot_memmap_num_entries(memmap);
-    kprintf("Memory map num entries: %u\n", num_entries);
+    // Tag TLB entries with address spaces
+    aspace_cpu_init();
 
-    for(int i = 0; i < multiboot_memmap_num_entries(memmap); i++)
+    if(!region_init() || !pcache_init())
     {
-        struct multiboot_memory_map_entry *entry = (struct multiboot_memory_map_entry*)(((u8*)memmap + 16) + i * memmap->entry_size);
-        u64 etype = (u64)entry->type;
-        u64 eaddr = (u64)entry->address;
-        u64 elen  = (u64)entry->length;
-        kprintf("Index: %d, Type: %d, Addr: %d, Len: %d\n", i, etype, eaddr, elen);
-
-        // Insert some memory chunk
-        if(etype == 1 && i != 3) // Dont load chunk were kernel lays TODO: find more dynamic approach to this
-        {
-            // NOTE: When adding chunk it must be correctly aligned to a even multiple of PAGE_SIZE
-            struct kchunk *kc = (struct kchunk*)eaddr;
-            bzero((void*)kc, sizeof(struct kchunk));
-            kc->addr = eaddr;
-            kc->size = elen / PAGE_SIZE;
-            ktree_insert(&kernel_heap.free_buddies[63 - __builtin_clzll(kc->size)], &kc->tree_handle, OFFSET(struct kchunk, tree_handle), (int (*)(void*, void*))cmp_chunks);
-        }
+        kprintf("Region setup failed\n");
+        kpanic();
     }
 
     kprintf("Kernel start %d\n", kernel_base_addr);
     kprintf("Kernel limit %d\n", kernel_limit_addr);
 
+    // Prefer memory mapped PCI config space
+    kprintf("PCI ECAM: %d\n", pci_ecam_init());
+
     pci_scan();
 
     // TODO: Find PCI device by vendor id
@@ -95,7 +106,7 @@ void kmain(struct multiboot_information *mb_info)
 
    
     // Test fs...
-    struct fs fs;
+    static struct fs fs;    // Too big for the stack
     fs_init(&fs, &blk_dev, true); 
     
     fs_mk(&fs, "/", "File", FS_TYPE_FILE);
@@ -169,6 +180,7 @@ void kmain(struct multiboot_information *mb_info)
     intr_enable();
  
     lapic_t la = lapic_init(0xF1, 0xF2, 0xF3, 0xF4);
+    tlb_cpu_init();
 
     #if 0
     lapic_timer_init(la, 0xF2, true, 1000000, 6);
@@ -191,9 +203,16 @@ void kmain(struct multiboot_information *mb_info)
 
     //switch_context(&ctx);
 
-    // Wait for interrupts
+#ifdef KMALLOC_TRACE
+    // Allocator usage after boot
+    pmm_dump_stats();
+    kmem_cache_dump_stats();
+#endif
+
+    // Wait for interrupts, zero free frames while there is nothing to do
     while(1) 
     {
-        __asm__ volatile("hlt");
+        if(!frame_zero_refill())
+            __asm__ volatile("hlt");
     }
 }
@@ -15,6 +15,12 @@ static struct multiboot_information* multiboot_next_tag(struct multiboot_informa
     return (struct multiboot_information*)(u64)p;
 }
 
+u64 multiboot_info_size(struct multiboot_information* mb_info)
+{
+    // Fixed part in front of the tags starts with the total size
+    return *(u32*)mb_info;
+}
+
 struct multiboot_memory_map* multiboot_memmap(struct multiboot_information* mb_info)
 {
     while(mb_info->type != 6)
@@ -34,5 +40,5 @@ struct multiboot_memory_map_entry* multiboot_memmap_entry(struct multiboot_memor
 {
     u64 num_entries = multiboot_memmap_num_entries(memmap);
     index = index % num_entries;
-    return (struct multiboot_memory_map_entry*)(memmap + 16 + index * memmap->entry_size);
+    return (struct multiboot_memory_map_entry*)((u8*)memmap + 16 + index * memmap->entry_size);
 }
\ No newline at end of file
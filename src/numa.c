@@ -0,0 +1,200 @@
+#include <numa.h>
+#include <percpu.h>
+
+static u64 numa_nodes = 1;
+static u32 numa_domains[NUMA_MAX_NODES];    // Proximity domain of each node
+
+static u8 numa_cpu_nodes[256];              // Indexed by APIC id
+
+static struct numa_range numa_ranges[NUMA_MAX_RANGES];
+static u64 numa_num_ranges = 0;
+
+static u8 numa_distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static u8 numa_order[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+/*
+ * Node for proximity domain, nodes are created on first sight
+ * Returns -1 if there are too many domains
+ */
+static i64 numa_domain_node(u32 domain)
+{
+    for(u64 i = 0; i < numa_nodes; i++)
+    {
+        if(numa_domains[i] == domain)
+            return i;
+    }
+
+    if(numa_nodes == NUMA_MAX_NODES)
+        return -1;
+
+    numa_domains[numa_nodes] = domain;
+    return numa_nodes++;
+}
+
+static void numa_parse_srat(struct acpi_srat *srat)
+{
+    u8 *ptr = srat->entries;
+    u8 *end = ((u8*)srat) + srat->hdr.length;
+
+    while(ptr + sizeof(struct acpi_srat_entry) <= end)
+    {
+        struct acpi_srat_entry *entry = (struct acpi_srat_entry*)ptr;
+
+        // Malformed table
+        if(entry->length == 0)
+            break;
+
+        if(entry->type == ACPI_SRAT_CPU)
+        {
+            struct acpi_srat_cpu *cpu = (struct acpi_srat_cpu*)entry;
+
+            u32 domain = cpu->domain_lo | (cpu->domain_hi[0] << 8) |
+                         (cpu->domain_hi[1] << 16) | (cpu->domain_hi[2] << 24);
+
+            i64 node = numa_domain_node(domain);
+
+            if((cpu->flags & ACPI_SRAT_ENABLED) && node != -1)
+                numa_cpu_nodes[cpu->apic_id] = node;
+        }
+        else if(entry->type == ACPI_SRAT_X2APIC)
+        {
+            struct acpi_srat_x2apic *cpu = (struct acpi_srat_x2apic*)entry;
+
+            i64 node = numa_domain_node(cpu->domain);
+
+            // Only xAPIC ids are used to identify cpus
+            if((cpu->flags & ACPI_SRAT_ENABLED) && node != -1 && cpu->x2apic_id < 256)
+                numa_cpu_nodes[cpu->x2apic_id] = node;
+        }
+        else if(entry->type == ACPI_SRAT_MEMORY)
+        {
+            struct acpi_srat_memory *mem = (struct acpi_srat_memory*)entry;
+
+            i64 node = numa_domain_node(mem->domain);
+
+            if((mem->flags & ACPI_SRAT_ENABLED) && node != -1 &&
+               mem->length_bytes != 0 && numa_num_ranges < NUMA_MAX_RANGES)
+            {
+                numa_ranges[numa_num_ranges].start = mem->base_addr;
+                numa_ranges[numa_num_ranges].end = mem->base_addr + mem->length_bytes;
+                numa_ranges[numa_num_ranges].node = node;
+                numa_num_ranges++;
+            }
+        }
+
+        ptr += entry->length;
+    }
+}
+
+static void numa_parse_slit(struct acpi_slit *slit)
+{
+    u64 n = slit->num_localities;
+
+    for(u64 i = 0; i < numa_nodes; i++)
+    {
+        for(u64 j = 0; j < numa_nodes; j++)
+        {
+            if(numa_domains[i] < n && numa_domains[j] < n)
+                numa_distances[i][j] = slit->distances[numa_domains[i] * n + numa_domains[j]];
+        }
+    }
+}
+
+void numa_init()
+{
+    numa_nodes = 0;
+    numa_num_ranges = 0;
+
+    bzero(numa_cpu_nodes, sizeof(numa_cpu_nodes));
+
+    struct acpi_srat *srat = (struct acpi_srat*)acpi_find_table("SRAT");
+    if(srat != NULL)
+        numa_parse_srat(srat);
+
+    // No affinity information, everything is local
+    if(numa_nodes == 0)
+    {
+        numa_nodes = 1;
+        numa_domains[0] = 0;
+        numa_num_ranges = 0;
+    }
+
+    // Default distances if SLIT is missing
+    for(u64 i = 0; i < numa_nodes; i++)
+    {
+        for(u64 j = 0; j < numa_nodes; j++)
+        {
+            numa_distances[i][j] = (i == j) ? NUMA_LOCAL_DISTANCE : 2 * NUMA_LOCAL_DISTANCE;
+        }
+    }
+
+    struct acpi_slit *slit = (struct acpi_slit*)acpi_find_table("SLIT");
+    if(slit != NULL)
+        numa_parse_slit(slit);
+
+    // Fallback order, sorted by distance (insertion sort keeps lower node first on ties)
+    for(u64 i = 0; i < numa_nodes; i++)
+    {
+        for(u64 j = 0; j < numa_nodes; j++)
+        {
+            u8 node = j;
+            i64 k = j - 1;
+
+            while(k >= 0 && numa_distances[i][numa_order[i][k]] > numa_distances[i][node])
+            {
+                numa_order[i][k + 1] = numa_order[i][k];
+                k--;
+            }
+
+            numa_order[i][k + 1] = node;
+        }
+    }
+}
+
+u64 numa_num_nodes()
+{
+    return numa_nodes;
+}
+
+u8 numa_cpu_node(u8 apic_id)
+{
+    return numa_cpu_nodes[apic_id];
+}
+
+u8 numa_local_node()
+{
+    return numa_cpu_nodes[this_cpu()->id];
+}
+
+u8 numa_memory_node(u64 addr, u64 *end)
+{
+    // Memory without affinity belongs to node 0 up to the next known range
+    u64 next = 0xFFFFFFFFFFFFFFFF;
+
+    for(u64 i = 0; i < numa_num_ranges; i++)
+    {
+        struct numa_range *range = &numa_ranges[i];
+
+        if(addr >= range->start && addr < range->end)
+        {
+            *end = range->end;
+            return range->node;
+        }
+
+        if(range->start > addr)
+            next = min(next, range->start);
+    }
+
+    *end = next;
+    return 0;
+}
+
+u8 numa_distance(u8 from, u8 to)
+{
+    return numa_distances[from][to];
+}
+
+u8* numa_fallback(u8 node)
+{
+    return numa_order[node];
+}
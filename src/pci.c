@@ -1,89 +1,189 @@
 #include <pci.h>
+#include <acpi.h>
+#include <sync.h>
 
 /* Note:
     In all pci_read_xxx/pci_write_xxx methods
-    REG needs to be aligned to a 4 byte boundary
+    REG needs to be aligned to the size of the access.
+    Registers above 0xFF (extended config space) are only
+    reachable when ECAM is available.
 */
 
-u32 pci_read_dword(pci_dev_t *pci_dev, u8 reg)
+// ECAM window of segment 0 (located via ACPI MCFG)
+static u64 pci_ecam_base = 0;
+static u8  pci_ecam_start_bus = 0;
+static u8  pci_ecam_end_bus = 0;
+
+// Serializes the 0xCF8/0xCFC port pair between cores
+static mutex_t pci_port_lock = 0;
+
+/**
+ * Locates the memory mapped configuration space
+ *
+ * @return True if ECAM is used from now on, false if we stay on port io
+ */
+bool pci_ecam_init()
 {
-    u32 pbus = ((u32)pci_dev->bus) << 16;
-    u32 pdev = ((u32)pci_dev->dev) << 11;
-    u32 pfun = ((u32)pci_dev->fun) << 8;
-    u32 preg = ((u32)reg) << 0;
+    struct acpi_mcfg *mcfg = (struct acpi_mcfg*)acpi_find_table("MCFG");
 
-    u32 addr = ((u32)0x80000000) | pbus | pdev | pfun | preg;
+    if(mcfg == NULL)
+        return false;
 
-    outd(PCI_ADDR, addr);
-    
-    return ind(PCI_DATA);
+    for(i64 i = 0; i < acpi_mcfg_num_entries(mcfg); i++)
+    {
+        // We only know about segment 0
+        if(mcfg->entries[i].segment == 0)
+        {
+            pci_ecam_start_bus = mcfg->entries[i].start_bus;
+            pci_ecam_end_bus   = mcfg->entries[i].end_bus;
+            pci_ecam_base      = mcfg->entries[i].base_addr;
+            return true;
+        }
+    }
+
+    return false;
 }
 
-u16 pci_read_word(pci_dev_t *pci_dev, u8 reg)
+bool pci_ecam_available()
 {
-    u32 pbus = ((u32)pci_dev->bus) << 16;
-    u32 pdev = ((u32)pci_dev->dev) << 11;
-    u32 pfun = ((u32)pci_dev->fun) << 8;
-    u32 preg = ((u32)reg) << 0;
+    return pci_ecam_base != 0;
+}
 
-    u32 addr = ((u32)0x80000000) | pbus | pdev | pfun | preg;
+// Returns address of register in ECAM window or 0 if not covered
+static u64 pci_ecam_addr(pci_dev_t *pci_dev, u16 reg)
+{
+    if(pci_ecam_base == 0 || 
+       pci_dev->bus < pci_ecam_start_bus || 
+       pci_dev->bus > pci_ecam_end_bus)
+    {
+        return 0;
+    }
 
-    outd(PCI_ADDR, addr);
-    
-    return inw(PCI_DATA);
+    u64 pbus = ((u64)(pci_dev->bus - pci_ecam_start_bus)) << 20;
+    u64 pdev = ((u64)pci_dev->dev) << 15;
+    u64 pfun = ((u64)pci_dev->fun) << 12;
+    u64 preg = ((u64)reg & 0xFFF);
+
+    return pci_ecam_base | pbus | pdev | pfun | preg;
 }
 
-u8 pci_read_byte(pci_dev_t *pci_dev, u8 reg)
+// Selects register for the port io data window
+static void pci_port_select(pci_dev_t *pci_dev, u16 reg)
 {
     u32 pbus = ((u32)pci_dev->bus) << 16;
     u32 pdev = ((u32)pci_dev->dev) << 11;
     u32 pfun = ((u32)pci_dev->fun) << 8;
-    u32 preg = ((u32)reg) << 0;
+    u32 preg = ((u32)reg) & 0xFC;
 
     u32 addr = ((u32)0x80000000) | pbus | pdev | pfun | preg;
 
     outd(PCI_ADDR, addr);
-    
-    return inb(PCI_DATA);
 }
 
-void pci_write_dword(pci_dev_t *pci_dev, u8 reg, u32 val)
+u32 pci_read_dword(pci_dev_t *pci_dev, u16 reg)
 {
-    u32 pbus = ((u32)pci_dev->bus) << 16;
-    u32 pdev = ((u32)pci_dev->dev) << 11;
-    u32 pfun = ((u32)pci_dev->fun) << 8;
-    u32 preg = ((u32)reg) << 0;
+    u64 ecam = pci_ecam_addr(pci_dev, reg);
+    if(ecam != 0)
+        return mmio_readd(ecam);
 
-    u32 addr = ((u32)0x80000000) | pbus | pdev | pfun | preg;
+    // Extended config space is not reachable via port io
+    if(reg > 0xFF)
+        return 0xFFFFFFFF;
 
-    outd(PCI_ADDR, addr);
+    mutex_lock(&pci_port_lock);
+    pci_port_select(pci_dev, reg);
+    u32 val = ind(PCI_DATA);
+    mutex_unlock(&pci_port_lock);
+
+    return val;
+}
+
+u16 pci_read_word(pci_dev_t *pci_dev, u16 reg)
+{
+    u64 ecam = pci_ecam_addr(pci_dev, reg);
+    if(ecam != 0)
+        return mmio_readw(ecam);
+
+    if(reg > 0xFF)
+        return 0xFFFF;
+
+    mutex_lock(&pci_port_lock);
+    pci_port_select(pci_dev, reg);
+    u16 val = inw(PCI_DATA + (reg & 0x2));
+    mutex_unlock(&pci_port_lock);
+
+    return val;
+}
+
+u8 pci_read_byte(pci_dev_t *pci_dev, u16 reg)
+{
+    u64 ecam = pci_ecam_addr(pci_dev, reg);
+    if(ecam != 0)
+        return mmio_readb(ecam);
+
+    if(reg > 0xFF)
+        return 0xFF;
+
+    mutex_lock(&pci_port_lock);
+    pci_port_select(pci_dev, reg);
+    u8 val = inb(PCI_DATA + (reg & 0x3));
+    mutex_unlock(&pci_port_lock);
+
+    return val;
+}
+
+void pci_write_dword(pci_dev_t *pci_dev, u16 reg, u32 val)
+{
+    u64 ecam = pci_ecam_addr(pci_dev, reg);
+    if(ecam != 0)
+    {
+        mmio_writed(ecam, val);
+        return;
+    }
+
+    if(reg > 0xFF)
+        return;
+
+    mutex_lock(&pci_port_lock);
+    pci_port_select(pci_dev, reg);
     outd(PCI_DATA, val);
+    mutex_unlock(&pci_port_lock);
 }
 
-void pci_write_word(pci_dev_t *pci_dev, u8 reg, u16 val)
+void pci_write_word(pci_dev_t *pci_dev, u16 reg, u16 val)
 {
-    u32 pbus = ((u32)pci_dev->bus) << 16;
-    u32 pdev = ((u32)pci_dev->dev) << 11;
-    u32 pfun = ((u32)pci_dev->fun) << 8;
-    u32 preg = ((u32)reg) << 0;
+    u64 ecam = pci_ecam_addr(pci_dev, reg);
+    if(ecam != 0)
+    {
+        mmio_writew(ecam, val);
+        return;
+    }
 
-    u32 addr = ((u32)0x80000000) | pbus | pdev | pfun | preg;
+    if(reg > 0xFF)
+        return;
 
-    outd(PCI_ADDR, addr);
-    outw(PCI_DATA, val);
+    mutex_lock(&pci_port_lock);
+    pci_port_select(pci_dev, reg);
+    outw(PCI_DATA + (reg & 0x2), val);
+    mutex_unlock(&pci_port_lock);
 }
 
-void pci_write_byte(pci_dev_t *pci_dev, u8 reg, u8 val)
+void pci_write_byte(pci_dev_t *pci_dev, u16 reg, u8 val)
 {
-    u32 pbus = ((u32)pci_dev->bus) << 16;
-    u32 pdev = ((u32)pci_dev->dev) << 11;
-    u32 pfun = ((u32)pci_dev->fun) << 8;
-    u32 preg = ((u32)reg) << 0;
+    u64 ecam = pci_ecam_addr(pci_dev, reg);
+    if(ecam != 0)
+    {
+        mmio_writeb(ecam, val);
+        return;
+    }
 
-    u32 addr = ((u32)0x80000000) | pbus | pdev | pfun | preg;
+    if(reg > 0xFF)
+        return;
 
-    outd(PCI_ADDR, addr);
-    outb(PCI_DATA, val);
+    mutex_lock(&pci_port_lock);
+    pci_port_select(pci_dev, reg);
+    outb(PCI_DATA + (reg & 0x3), val);
+    mutex_unlock(&pci_port_lock);
 }
 
 bool pci_ready(pci_dev_t *pci_dev)
@@ -0,0 +1,51 @@
+#include <io.h>
+#include <percpu.h>
+
+extern char global_descriptor_table[];
+extern void tss_load();
+
+static struct percpu percpu_cpus[MAX_CPUS];
+
+struct gdt_descriptor
+{
+    u16 limit;
+    u64 base;
+} __attribute__((packed));
+
+bool percpu_init(u64 stack)
+{
+    u8 id = cpu_id();
+    if(id >= MAX_CPUS)
+        return false;
+
+    struct percpu *cpu = &percpu_cpus[id];
+
+    cpu->self = cpu;
+    cpu->id = id;
+    cpu->aspace = NULL;
+
+    cpu->root.kernel_stack = stack;
+
+    // Same segments as the boot GDT, only the TSS differs
+    memcpy(cpu->gdt, global_descriptor_table, sizeof(cpu->gdt));
+    tss_init(&cpu->tss, cpu->gdt, stack);
+
+    struct gdt_descriptor gdtr = {.limit = sizeof(cpu->gdt) - 1, .base = (u64)cpu->gdt};
+    __asm__ volatile("lgdt %0" : : "m"(gdtr));
+
+    tss_load();
+
+    // Kernel mode runs with the cpu's data in GS, user mode starts with a zero base
+    wmsr(MSR_IA32_GS_BASE, (u64)cpu);
+    wmsr(MSR_IA32_KERNEL_GS_BASE, 0);
+
+    return true;
+}
+
+struct percpu* percpu_cpu(u8 id)
+{
+    if(id >= MAX_CPUS || percpu_cpus[id].self == NULL)
+        return NULL;
+
+    return &percpu_cpus[id];
+}
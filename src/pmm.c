@@ -1,4 +1,10 @@
 #include <pmm.h>
+#include <vga.h>
+#include <vmm.h>
+#include <apic.h>
+#include <intr.h>
+#include <frame.h>
+#include <percpu.h>
 
 #define ABS(x) ((x < 0) ? (-x) : x)
 
@@ -51,9 +57,10 @@ int cmp_chunks(struct kchunk *c0, struct kchunk* c1)
     return 1;
 }
 
-void kheap_init(struct kheap *heap)
+void kheap_init(struct kheap *heap, u8 node)
 {
     bzero((void*)heap, sizeof(struct kheap));
+    heap->node = node;
 }
 
 static void split_chunk(struct kchunk chunk_to_split, struct kchunk **new_chunk0, struct kchunk **new_chunk1)
@@ -73,7 +80,10 @@ static void split_chunk(struct kchunk chunk_to_split, struct kchunk **new_chunk0
     (*new_chunk1)->size = new_size;
 }
 
-i64 kheap_alloc(struct kheap *heap, i64 size)
+/*
+ * Index in free buddy array for allocation of size bytes
+ */
+static i64 kheap_index(i64 size)
 {
     size = ABS(size);
 
@@ -86,42 +96,76 @@ i64 kheap_alloc(struct kheap *heap, i64 size)
     // Next closest power of 2 num of pages
     i64 chunk_size_in_pages = __p2(pages) ? pages : __rp2(pages);
 
+    return 63 - __builtin_clzll((u64)chunk_size_in_pages);
+}
+
+/*
+ * Adds a block of at least 2^index pages from the frame allocator to the heap
+ */
+static bool kheap_grow(struct kheap *heap, i64 index)
+{
+    // Take big blocks to keep the number of trips low, but settle for less
+    i64 order = max(index, KHEAP_GROW_ORDER);
+    i64 addr = frame_alloc_node(heap->node, order);
+
+    if(addr == -1 && order > index)
+    {
+        order = index;
+        addr = frame_alloc_node(heap->node, order);
+    }
+
+    if(addr == -1)
+        return false;
+
+    // Frame blocks are naturally aligned, so buddy merging stays valid
+    struct kchunk *chunk = (struct kchunk*)addr;
+    bzero((void*)chunk, sizeof(struct kchunk));
+    chunk->addr = addr;
+    chunk->size = 1 << order;
+
+    heap->stats.heap_pages += 1 << order;
+
+    ktree_insert(&heap->free_buddies[order], 
+                &chunk->tree_handle, 
+                OFFSET(struct kchunk, tree_handle), 
+                (int (*)(void*, void*))cmp_chunks);
+
+    return true;
+}
+
+static i64 __kheap_alloc(struct kheap *heap, i64 size)
+{
     // Get index in free buddy array
-    i64 index = 63 - __builtin_clzll((u64)chunk_size_in_pages);
+    i64 index = kheap_index(size);
     if(ktree_empty(&heap->free_buddies[index]))
     {
         int i = index;
-        while(i < 48) 
+        while(i < 48 && ktree_empty(&heap->free_buddies[i]))
         {
-            if(i >= 48)
+            i++;
+        }
+
+        if(i >= 48)
+        {
+            // Out of memory
+            if(!kheap_grow(heap, index))
             {
-                // Out of memory
+                heap->stats.failed++;
                 return -1;
             }
-            else
-            {
-                if(ktree_empty(&heap->free_buddies[i]))
-                {
-                    i++;
-                }
-                else
-                {
-                    break;
-                }
-            }
+
+            return __kheap_alloc(heap, size);
         }
 
         // Need (i - index) splits to create chunk of appropriate size
         for(i64 j = i; j > index; j--)
         {
-            // Save old "big" chunk
-            struct kchunk rc = *ENCLAVE(struct kchunk, tree_handle, heap->free_buddies[j].root);
+            // Save old "big" chunk (lowest address keeps the heap compact)
+            struct ktree_node *big = ktree_first(&heap->free_buddies[j]);
+            struct kchunk rc = *ENCLAVE(struct kchunk, tree_handle, big);
 
             // Remove old "big" chunk
-            ktree_remove(&heap->free_buddies[j], 
-                        heap->free_buddies[j].root, 
-                        OFFSET(struct kchunk, tree_handle), 
-                        (int (*)(void*, void*))cmp_chunks);
+            ktree_remove(&heap->free_buddies[j], big);
 
             // Split bigger chunk
             struct kchunk *nc0;
@@ -138,16 +182,14 @@ i64 kheap_alloc(struct kheap *heap, i64 size)
     }
 
     // Get actual chunk
-    struct kchunk *chunk = ENCLAVE(struct kchunk, tree_handle, heap->free_buddies[index].root);
+    struct kchunk *chunk = ENCLAVE(struct kchunk, tree_handle, ktree_first(&heap->free_buddies[index]));
 
     // Remove chunk from free list
-    ktree_remove(&heap->free_buddies[index], 
-                &chunk->tree_handle,
-                OFFSET(struct kchunk, tree_handle), 
-                (int (*)(void*, void*))cmp_chunks);
+    ktree_remove(&heap->free_buddies[index], &chunk->tree_handle);
 
     // Remove old and invalid tree information
     bzero((void*)&chunk->tree_handle, sizeof(struct ktree_node));
+    chunk->state = KCHUNK_FREE;
 
     // Insert in used (but now by address)
     ktree_insert(&heap->used_buddies, 
@@ -155,11 +197,15 @@ i64 kheap_alloc(struct kheap *heap, i64 size)
                 OFFSET(struct kchunk, tree_handle), 
                 (int (*)(void*, void*))cmp_chunks);
 
+    heap->stats.allocs++;
+    heap->stats.used_pages += chunk->size;
+    heap->stats.peak_pages = max(heap->stats.peak_pages, heap->stats.used_pages);
+
     // Return address
     return (chunk->addr + sizeof(struct kchunk));
 }
 
-i64 kheap_free(struct kheap *heap, i64 addr)
+static i64 __kheap_free(struct kheap *heap, i64 addr)
 {   
     // Query struct
     struct kchunk query;
@@ -180,15 +226,16 @@ i64 kheap_free(struct kheap *heap, i64 addr)
 
     // Get kchunk for search result
     freed = ENCLAVE(struct kchunk, tree_handle, sr);
+    freed->state = KCHUNK_FREE;
 
     // Index in free_buddies array
     i64 index = 63 - __builtin_clzll((u64)freed->size);
 
+    heap->stats.frees++;
+    heap->stats.used_pages -= freed->size;
+
     // Remove chunk from used
-    ktree_remove(&heap->used_buddies, 
-                &freed->tree_handle, 
-                OFFSET(struct kchunk, tree_handle),
-                (int (*)(void*, void*))cmp_chunks);
+    ktree_remove(&heap->used_buddies, &freed->tree_handle);
     
     bzero((void*)&freed->tree_handle, sizeof(struct ktree_node));
 
@@ -227,17 +274,11 @@ i64 kheap_free(struct kheap *heap, i64 addr)
             buddy = ENCLAVE(struct kchunk, tree_handle, sr);
          
             // Remove both from free
-            ktree_remove(&heap->free_buddies[index], 
-                &buddy->tree_handle, 
-                OFFSET(struct kchunk, tree_handle),
-                (int (*)(void*, void*))cmp_chunks);
+            ktree_remove(&heap->free_buddies[index], &buddy->tree_handle);
 
             bzero((void*)&buddy->tree_handle, sizeof(struct ktree_node));
 
-            ktree_remove(&heap->free_buddies[index], 
-                &freed->tree_handle, 
-                OFFSET(struct kchunk, tree_handle),
-                (int (*)(void*, void*))cmp_chunks);
+            ktree_remove(&heap->free_buddies[index], &freed->tree_handle);
 
             bzero((void*)&freed->tree_handle, sizeof(struct ktree_node));
 
@@ -265,14 +306,491 @@ i64 kheap_free(struct kheap *heap, i64 addr)
     return 0;
 }
 
-struct kheap kernel_heap;
+i64 kheap_alloc(struct kheap *heap, i64 size)
+{
+    u64 flags = intr_save();
+    mutex_lock(&heap->lock);
+
+    i64 ret = __kheap_alloc(heap, size);
+
+    mutex_unlock(&heap->lock);
+    intr_restore(flags);
+
+    return ret;
+}
+
+i64 kheap_free(struct kheap *heap, i64 addr)
+{
+    u64 flags = intr_save();
+    mutex_lock(&heap->lock);
+
+    i64 ret = __kheap_free(heap, addr);
+
+    mutex_unlock(&heap->lock);
+    intr_restore(flags);
+
+    return ret;
+}
+
+// One heap per NUMA node, each grows only from its own node's frames
+struct kheap kernel_heaps[NUMA_MAX_NODES];
+
+/*
+ * Heap a chunk was taken from
+ */
+static struct kheap* kheap_owner(i64 addr)
+{
+    struct page *page = frame_page(addr);
+    return &kernel_heaps[(page != NULL) ? page->node : 0];
+}
+
+/*
+ * Move up to KMAG_BATCH chunks of the magazine's size from the heap into it
+ */
+static void kmag_refill(struct kheap *heap, struct kmagazine *mag, i64 index)
+{
+    // Largest allocation that still fits into a chunk of this index
+    i64 size = (1 << index) * PAGE_SIZE - sizeof(struct kchunk);
+
+    mutex_lock(&heap->lock);
+
+    for(i64 i = 0; i < KMAG_BATCH && mag->count < KMAG_SIZE; i++)
+    {
+        i64 addr = __kheap_alloc(heap, size);
+        if(addr == -1)
+            break;
+
+        mag->chunks[mag->count++] = addr;
+    }
+
+    mutex_unlock(&heap->lock);
+}
+
+/*
+ * Return the KMAG_BATCH oldest chunks to the heap
+ */
+static void kmag_drain(struct kheap *heap, struct kmagazine *mag)
+{
+    i64 n = min(KMAG_BATCH, mag->count);
+
+    mutex_lock(&heap->lock);
+
+    for(i64 i = 0; i < n; i++)
+    {
+        __kheap_free(heap, mag->chunks[i]);
+    }
+
+    mutex_unlock(&heap->lock);
+
+    // Keep the recently freed (cache hot) chunks
+    for(i64 i = n; i < mag->count; i++)
+    {
+        mag->chunks[i - n] = mag->chunks[i];
+    }
+    mag->count -= n;
+}
+
+/*
+ * Allocates from the nearest node that has memory left
+ */
+static i64 kmalloc_fallback(u8 node, i64 size)
+{
+    u8 *fallback = numa_fallback(node);
+
+    for(u64 i = 0; i < numa_num_nodes(); i++)
+    {
+        i64 ret = kheap_alloc(&kernel_heaps[fallback[i]], size);
+        if(ret != -1)
+            return ret;
+    }
+
+    return -1;
+}
+
+#ifdef KMALLOC_TRACE
+
+static struct kmalloc_site kmalloc_sites[KMALLOC_TRACE_SITES];
+static mutex_t kmalloc_sites_lock = 0;
+
+/*
+ * Slot of a call site (open addressing), NULL if the table is full
+ */
+static struct kmalloc_site* kmalloc_site(u64 site)
+{
+    u64 slot = (site >> 2) % KMALLOC_TRACE_SITES;
+
+    for(u64 i = 0; i < KMALLOC_TRACE_SITES; i++)
+    {
+        struct kmalloc_site *entry = &kmalloc_sites[(slot + i) % KMALLOC_TRACE_SITES];
+
+        if(entry->site == site || entry->site == 0)
+        {
+            entry->site = site;
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static void kmalloc_trace(i64 addr, i64 size, u64 site, bool alloc)
+{
+    struct kchunk *chunk = (struct kchunk*)(addr - sizeof(struct kchunk));
+
+    if(alloc)
+    {
+        chunk->site = site;
+        chunk->req_size = size;
+    }
+
+    u64 flags = intr_save();
+    mutex_lock(&kmalloc_sites_lock);
+
+    struct kmalloc_site *entry = kmalloc_site(chunk->site);
+
+    if(entry != NULL)
+    {
+        if(alloc)
+        {
+            entry->allocs++;
+            entry->live_bytes += chunk->req_size;
+        }
+        else
+        {
+            entry->frees++;
+            entry->live_bytes -= chunk->req_size;
+        }
+    }
+
+    mutex_unlock(&kmalloc_sites_lock);
+    intr_restore(flags);
+}
+
+#endif
+
+static i64 __kmalloc(i64 size)
+{
+    i64 index = kheap_index(size);
+    struct percpu *cpu = this_cpu();
+    u8 node = numa_cpu_node(cpu->id);
+
+    if(index >= KMAG_ORDERS)
+        return kmalloc_fallback(node, size);
+
+    // Magazines are per cpu, so only interrupts can race with us
+    u64 flags = intr_save();
+
+    struct kmag_cpu *kmag = &cpu->kmag;
+    struct kmagazine *mag = &kmag->mags[index];
+
+    kmag->allocs++;
+
+    // Magazines only hold chunks of the cpu's own node
+    if(mag->count == 0)
+        kmag_refill(&kernel_heaps[node], mag, index);
+    else
+        kmag->hits++;
+
+    i64 ret = (mag->count > 0) ? mag->chunks[--mag->count] : -1;
+
+    intr_restore(flags);
+
+    // Local node is exhausted
+    if(ret == -1)
+        ret = kmalloc_fallback(node, size);
+
+    return ret;
+}
 
 i64 kmalloc(i64 size)
 {
-    return kheap_alloc(&kernel_heap, size);
+    i64 ret = __kmalloc(size);
+
+    if(ret != -1)
+        ((struct kchunk*)(ret - sizeof(struct kchunk)))->state = KCHUNK_USED;
+
+#ifdef KMALLOC_TRACE
+    if(ret != -1)
+        kmalloc_trace(ret, size, (u64)__builtin_return_address(0), true);
+#endif
+
+    return ret;
 }
 
 i64 kfree(i64 addr)
 {
-    return kheap_free(&kernel_heap, addr);
-}
\ No newline at end of file
+    // Never handed out by kmalloc
+    if(addr <= (i64)sizeof(struct kchunk))
+        return -1;
+
+    // Chunk header sits right in front of the allocation
+    struct kchunk *chunk = (struct kchunk*)(addr - sizeof(struct kchunk));
+    struct kheap *heap = kheap_owner((i64)chunk);
+
+    struct percpu *cpu = this_cpu();
+
+    bool valid = chunk->addr == addr - (i64)sizeof(struct kchunk);
+
+    // Not a chunk, the heap's used tree has the final say
+    if(!valid)
+        return kheap_free(heap, addr);
+
+    // Double free
+    if(chunk->state != KCHUNK_USED)
+        return -1;
+
+    chunk->state = KCHUNK_FREE;
+
+#ifdef KMALLOC_TRACE
+    kmalloc_trace(addr, 0, 0, false);
+#endif
+
+    i64 index = 63 - __builtin_clzll((u64)chunk->size);
+
+    // Remote chunks go straight back to their heap
+    if(index >= KMAG_ORDERS || heap->node != numa_cpu_node(cpu->id))
+        return kheap_free(heap, addr);
+
+    u64 flags = intr_save();
+
+    struct kmag_cpu *kmag = &cpu->kmag;
+    struct kmagazine *mag = &kmag->mags[index];
+
+    kmag->frees++;
+
+    if(mag->count == KMAG_SIZE)
+        kmag_drain(heap, mag);
+    else
+        kmag->hits++;
+
+    mag->chunks[mag->count++] = addr;
+
+    intr_restore(flags);
+
+    return 0;
+}
+
+// Linker variables
+extern char kernel_base[];
+extern char kernel_limit[];
+
+// Physical range which must not be handed to the frame allocator
+struct pmm_range
+{
+    u64 start;
+    u64 end;
+};
+
+#define PMM_MAX_EXCLUDED 8
+
+static struct pmm_range pmm_excluded[PMM_MAX_EXCLUDED];
+static u64 pmm_num_excluded = 0;
+
+// Location of frame meta information, followed by fallback identity mapping directories
+static u64 pmm_map_addr = 0;
+static u64 pmm_map_size = 0;
+static u64 pmm_id_size = 0;
+
+static void pmm_exclude(u64 start, u64 end)
+{
+    if(pmm_num_excluded == PMM_MAX_EXCLUDED)
+        return;
+
+    pmm_excluded[pmm_num_excluded].start = start - (start % PAGE_SIZE);
+    pmm_excluded[pmm_num_excluded].end = align(end, PAGE_SIZE);
+    pmm_num_excluded++;
+}
+
+/*
+ * Calls fn for every part of [start, end) not covered by excluded ranges
+ */
+static void pmm_usable(u64 start, u64 end, u64 first, void (*fn)(u64, u64))
+{
+    for(u64 i = first; i < pmm_num_excluded; i++)
+    {
+        struct pmm_range *ex = &pmm_excluded[i];
+
+        if(ex->start < end && start < ex->end)
+        {
+            if(start < ex->start)
+                pmm_usable(start, ex->start, i + 1, fn);
+            if(ex->end < end)
+                pmm_usable(ex->end, end, i + 1, fn);
+            return;
+        }
+    }
+
+    fn(start, end);
+}
+
+static void pmm_place_map(u64 start, u64 end)
+{
+    start = align(start, PAGE_SIZE);
+
+    u64 size = pmm_map_size + pmm_id_size;
+
+    // Must be reachable through the boot time identity mapping (first 4GiB)
+    if(pmm_map_addr == 0 && start + size <= end && start + size <= PAGE_ID_BOOT_END)
+    {
+        pmm_map_addr = start;
+    }
+}
+
+bool pmm_init(struct multiboot_information *mb_info)
+{
+    struct multiboot_memory_map *memmap = multiboot_memmap(mb_info);
+    u64 num_entries = multiboot_memmap_num_entries(memmap);
+
+    // End of ram and number of usable frames
+    u64 ram_end = 0;
+    u64 ram_frames = 0;
+
+    for(u64 i = 0; i < num_entries; i++)
+    {
+        struct multiboot_memory_map_entry *entry = multiboot_memmap_entry(memmap, i);
+
+        if(entry->type != MULTIBOOT_MEMORY_AVAILABLE)
+            continue;
+
+        u64 start = align(entry->address, PAGE_SIZE);
+        u64 end = (entry->address + entry->length) & ~PAGE_MASK;
+
+        if(start >= end)
+            continue;
+
+        ram_end = max(ram_end, end);
+        ram_frames += (end - start) / PAGE_SIZE;
+    }
+
+    // Memory beyond the identity mapping can't be used
+    ram_end = min(ram_end, PAGE_ID_LIMIT);
+
+    // Node layout decides which zone frames go to
+    numa_init();
+
+    for(u64 i = 0; i < NUMA_MAX_NODES; i++)
+    {
+        kheap_init(&kernel_heaps[i], i);
+    }
+
+    pmm_num_excluded = 0;
+
+    // Real mode IVT and BIOS data area
+    pmm_exclude(0, PAGE_SIZE);
+    // AP trampoline (linked to a fixed address outside of the kernel image)
+    pmm_exclude(IPI_TRAMPOLINE_ORIGIN, IPI_TRAMPOLINE_ORIGIN + PAGE_SIZE);
+    // Kernel image
+    pmm_exclude((u64)kernel_base, (u64)kernel_limit);
+    // Boot time identity mapping (already part of the image's bss, listed for clarity)
+    pmm_exclude((u64)&page_id_ptr, (u64)&page_id_tab[PAGE_ID_NUM_TABS]);
+    // Multiboot information
+    pmm_exclude((u64)mb_info, (u64)mb_info + multiboot_info_size(mb_info));
+
+    // Find a home for the frame meta information
+    pmm_map_size = frame_map_size(ram_end / PAGE_SIZE);
+    pmm_id_size = paging_id_tables(ram_end) * PAGE_SIZE;
+    pmm_map_addr = 0;
+
+    for(u64 i = 0; i < num_entries; i++)
+    {
+        struct multiboot_memory_map_entry *entry = multiboot_memmap_entry(memmap, i);
+
+        if(entry->type == MULTIBOOT_MEMORY_AVAILABLE)
+            pmm_usable(entry->address, entry->address + entry->length, 0, pmm_place_map);
+    }
+
+    if(pmm_map_addr == 0)
+        return false;
+
+    pmm_exclude(pmm_map_addr, pmm_map_addr + pmm_map_size + pmm_id_size);
+
+    // Frames above 4GiB must be reachable before they are handed out
+    paging_id_full(ram_end, (struct page_table*)(pmm_map_addr + pmm_map_size));
+
+    frame_init((struct page*)pmm_map_addr, ram_end / PAGE_SIZE);
+
+    // Everything left is carved into naturally aligned blocks
+    for(u64 i = 0; i < num_entries; i++)
+    {
+        struct multiboot_memory_map_entry *entry = multiboot_memmap_entry(memmap, i);
+
+        if(entry->type == MULTIBOOT_MEMORY_AVAILABLE)
+            pmm_usable(entry->address, entry->address + entry->length, 0, frame_add_range);
+    }
+
+    u64 free_frames = frame_free_count();
+
+    kprintf("Frames total: %u, free: %u, reserved: %u\n", 
+            ram_frames, free_frames, ram_frames - free_frames);
+
+    for(u64 i = 0; i < numa_num_nodes(); i++)
+    {
+        // 1 GiB blocks only exist while memory isn't fragmented
+        u64 huge = frame_reserve_1g(i, (frame_node_free_count(i) >> PMM_HUGE_RESERVE_SHIFT) >> FRAME_ORDER_1G);
+
+        kprintf("Node %u: %u free frames, %u 1 GiB frames reserved\n", i, frame_node_free_count(i), huge);
+    }
+
+    return true;
+}
+
+void pmm_dump_stats()
+{
+    for(u64 n = 0; n < numa_num_nodes(); n++)
+    {
+        frame_dump_stats(n);
+
+        struct kheap *heap = &kernel_heaps[n];
+
+        u64 flags = intr_save();
+        mutex_lock(&heap->lock);
+
+        struct kheap_stats stats = heap->stats;
+
+        // Free chunks per order (only orders with chunks)
+        kprintf("Node %u free chunks:", n);
+        for(u64 i = 0; i < 48; i++)
+        {
+            u64 count = 0;
+            for(struct ktree_node *node = ktree_first(&heap->free_buddies[i]); node != NULL; node = ktree_next(node))
+            {
+                count++;
+            }
+
+            if(count != 0)
+                kprintf(" %u:%u", i, count);
+        }
+        kprintf("\n");
+
+        mutex_unlock(&heap->lock);
+        intr_restore(flags);
+
+        kprintf("Node %u heap: %u pages, used %u (peak %u), allocs %u, frees %u, failed %u\n",
+                n, stats.heap_pages, stats.used_pages, stats.peak_pages, 
+                stats.allocs, stats.frees, stats.failed);
+    }
+
+    for(u64 i = 0; i < MAX_CPUS; i++)
+    {
+        struct percpu *cpu = percpu_cpu(i);
+        if(cpu == NULL)
+            continue;
+
+        struct kmag_cpu *kmag = &cpu->kmag;
+
+        if(kmag->allocs != 0 || kmag->frees != 0)
+            kprintf("Cpu %u: kmalloc %u, kfree %u, magazine hits %u\n", 
+                    i, kmag->allocs, kmag->frees, kmag->hits);
+    }
+
+#ifdef KMALLOC_TRACE
+    for(u64 i = 0; i < KMALLOC_TRACE_SITES; i++)
+    {
+        struct kmalloc_site *entry = &kmalloc_sites[i];
+
+        if(entry->site != 0)
+            kprintf("Site %h: allocs %u, frees %u, live bytes %d\n", 
+                    entry->site, entry->allocs, entry->frees, entry->live_bytes);
+    }
+#endif
+}
@@ -0,0 +1,567 @@
+#include <tlb.h>
+#include <intr.h>
+#include <slab.h>
+#include <frame.h>
+#include <region.h>
+#include <fs/pcache.h>
+
+static struct kmem_cache *region_cache = NULL;
+
+// Overlapping ranges compare equal, so looking up a single page yields the region containing it
+static int cmp_regions(struct region *r0, struct region *r1)
+{
+    if(r0->end <= r1->start)
+        return -1;
+    if(r0->start >= r1->end)
+        return 1;
+    return 0;
+}
+
+bool region_init()
+{
+    region_cache = kmem_cache_create("region", sizeof(struct region), 0, NULL);
+    return region_cache != NULL;
+}
+
+/*
+ * Region overlapping [start, end), address space lock must be held
+ */
+static struct region* region_find(struct aspace *as, u64 start, u64 end)
+{
+    struct region query = {.start = start, .end = end};
+    struct ktree_node *node = NULL;
+
+    if(!ktree_find(&as->regions, &query, OFFSET(struct region, tree_handle), (int (*)(void*, void*))cmp_regions, &node))
+        return NULL;
+
+    return (ENCLAVE(struct region, tree_handle, node));
+}
+
+/*
+ * Region containing page unless it is being unmapped, address space lock must be held
+ */
+static struct region* region_live(struct aspace *as, u64 page)
+{
+    struct region *region = region_find(as, page, page + PAGE_SIZE);
+    return (region != NULL && !region->dying) ? region : NULL;
+}
+
+static bool region_add(struct aspace *as, struct region *desc)
+{
+    if(region_cache == NULL)
+        return false;
+
+    // Page aligned and inside the user part
+    if((desc->start & PAGE_MASK) != 0 || desc->start >= desc->end ||
+       desc->start < ASPACE_USER_START || desc->end > ASPACE_USER_END)
+        return false;
+
+    struct region *region = kmem_cache_alloc(region_cache);
+    if(region == NULL)
+        return false;
+
+    memcpy(region, desc, sizeof(struct region));
+
+    u64 flags = intr_save();
+    tlb_mutex_lock(&as->lock);
+
+    bool ret = region_find(as, region->start, region->end) == NULL;
+
+    if(ret)
+        ktree_insert(&as->regions, &region->tree_handle, OFFSET(struct region, tree_handle), (int (*)(void*, void*))cmp_regions);
+
+    mutex_unlock(&as->lock);
+    intr_restore(flags);
+
+    if(!ret)
+        kmem_cache_free(region_cache, region);
+
+    return ret;
+}
+
+bool region_map_anon(struct aspace *as, u64 start, u64 size, u64 flags)
+{
+    struct region desc = {.start = start, .end = start + align(size, PAGE_SIZE), .type = REGION_ANON, .flags = flags};
+    return region_add(as, &desc);
+}
+
+bool region_map_file(struct aspace *as, u64 start, u64 size, u64 flags, struct fs *fs, i64 handle, i64 offset)
+{
+    if(offset < 0 || (offset % FS_BLOCK_SIZE) != 0)
+        return false;
+
+    struct region desc = {.start = start, .end = start + align(size, PAGE_SIZE), .type = REGION_FILE, .flags = flags,
+                          .fs = fs, .handle = handle, .offset = offset};
+    return region_add(as, &desc);
+}
+
+bool region_map_shared(struct aspace *as, u64 start, u64 size, u64 flags, struct fs *fs, i64 handle, i64 offset)
+{
+    if(offset < 0 || (offset % FS_BLOCK_SIZE) != 0)
+        return false;
+
+    struct region desc = {.start = start, .end = start + align(size, PAGE_SIZE), .type = REGION_SHARED, .flags = flags,
+                          .fs = fs, .handle = handle, .offset = offset};
+    return region_add(as, &desc);
+}
+
+bool region_map_device(struct aspace *as, u64 start, u64 size, u64 flags, u64 phys)
+{
+    if((phys & PAGE_MASK) != 0)
+        return false;
+
+    struct region desc = {.start = start, .end = start + align(size, PAGE_SIZE), .type = REGION_DEVICE, .flags = flags,
+                          .phys = phys};
+    return region_add(as, &desc);
+}
+
+/*
+ * Takes the reference a new mapping of a page of the region holds on its frame
+ */
+static void region_acquire(struct region *region, u64 addr, u64 phys)
+{
+    if(region->type == REGION_SHARED)
+        pcache_get(region->fs, region->handle, region->offset + (addr - region->start));
+    else if(region->type != REGION_DEVICE)
+        frame_get(phys);
+}
+
+/*
+ * Drops the reference of a mapping (entry is its last page table entry), dirty shared pages are written back
+ */
+static void region_release(struct region *region, u64 addr, u64 entry)
+{
+    if(region->type == REGION_SHARED)
+        pcache_put(region->fs, region->handle, region->offset + (addr - region->start), (entry & PAGE_DIRTY) != 0);
+    else if(region->type != REGION_DEVICE)
+        frame_put(entry & PAGE_ADDR_MASK);
+}
+
+/*
+ * Unmaps all pages of a dying (or removed) region and releases their frames,
+ * with flush the TLBs of cpus having the address space active are flushed first
+ */
+static void region_unmap_pages(struct aspace *as, struct region *region, bool flush)
+{
+    u64 entries[TLB_MAX_PAGES];
+    u64 addrs[TLB_MAX_PAGES];
+
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, as);
+
+    u64 addr = region->start;
+
+    while(addr < region->end)
+    {
+        u64 num_frames = 0;
+
+        u64 flags = intr_save();
+        tlb_mutex_lock(&as->lock);
+
+        // Others may have changed the tables while the lock was dropped
+        struct paging_cursor cur;
+        paging_cursor_init(&cur, as->root);
+
+        // Up to a batch of mapped pages, untouched ranges are skipped table by table
+        while(num_frames < TLB_MAX_PAGES && (addr = paging_cursor_next(&cur, addr, region->end)) < region->end)
+        {
+            // The dirty bit decides about write back
+            u64 entry = paging_cursor_unmap(&cur, addr);
+
+            if(entry != 0)
+            {
+                entries[num_frames] = entry;
+                addrs[num_frames++] = addr;
+
+                if(flush)
+                    tlb_batch_add(&batch, addr, 1);
+            }
+
+            addr += PAGE_SIZE;
+        }
+
+        mutex_unlock(&as->lock);
+        intr_restore(flags);
+
+        // Shootdown without the lock, faults on other pages go on meanwhile
+        tlb_batch_flush(&batch);
+
+        // Frames may still be shared with forks or other mappings of the file
+        for(u64 i = 0; i < num_frames; i++)
+        {
+            region_release(region, addrs[i], entries[i]);
+        }
+    }
+}
+
+bool region_unmap(struct aspace *as, u64 start)
+{
+    u64 flags = intr_save();
+    tlb_mutex_lock(&as->lock);
+
+    struct region *region = region_live(as, start);
+    bool found = region != NULL && region->start == start;
+
+    // No more pages are faulted in from here on, but the range can't be reused yet
+    if(found)
+        region->dying = true;
+
+    mutex_unlock(&as->lock);
+    intr_restore(flags);
+
+    if(!found)
+        return false;
+
+    region_unmap_pages(as, region, true);
+
+    flags = intr_save();
+    tlb_mutex_lock(&as->lock);
+
+    ktree_remove(&as->regions, &region->tree_handle);
+
+    mutex_unlock(&as->lock);
+    intr_restore(flags);
+
+    kmem_cache_free(region_cache, region);
+
+    return true;
+}
+
+void region_clear(struct aspace *as)
+{
+    struct ktree_node *node;
+
+    while((node = ktree_first(&as->regions)) != NULL)
+    {
+        struct region *region = (ENCLAVE(struct region, tree_handle, node));
+
+        ktree_remove(&as->regions, node);
+
+        // Not active anywhere, stale entries of its PCID are flushed when the PCID is reused
+        region_unmap_pages(as, region, false);
+
+        kmem_cache_free(region_cache, region);
+    }
+}
+
+/*
+ * Frame holding the content of a page of the region, -1 if out of memory or on io errors
+ */
+static i64 region_fill(struct region *region, u64 addr)
+{
+    u64 off = addr - region->start;
+
+    if(region->type == REGION_ANON)
+        return frame_zalloc(0);
+
+    if(region->type == REGION_DEVICE)
+        return region->phys + off;
+
+    if(region->type == REGION_SHARED)
+        return pcache_get(region->fs, region->handle, region->offset + off);
+
+    i64 frame = frame_alloc(0);
+    if(frame == -1)
+        return -1;
+
+    if(!fs_read_page(region->fs, region->handle, region->offset + off, (u8*)frame))
+    {
+        frame_free(frame);
+        return -1;
+    }
+
+    return frame;
+}
+
+/*
+ * Write to a present read only page, copies it if it's shared copy on write
+ */
+static bool region_cow(struct aspace *as, u64 page, u64 error)
+{
+    tlb_mutex_lock(&as->lock);
+
+    struct region *region = region_live(as, page);
+    u64 *entry = paging_leaf(as->root, page);
+
+    bool ret = region != NULL && entry != NULL &&
+               (region->flags & PAGE_WRITABLE) &&
+               (!(error & PF_USER) || (region->flags & PAGE_USER));
+
+    // Another cpu resolved it already, or it was unmapped and faults again as missing
+    if(!ret || !(*entry & PAGE_PRESENT) || (*entry & PAGE_WRITABLE))
+    {
+        mutex_unlock(&as->lock);
+        return ret;
+    }
+
+    if(!(*entry & PAGE_COW))
+    {
+        mutex_unlock(&as->lock);
+        return false;
+    }
+
+    u64 phys = *entry & PAGE_ADDR_MASK;
+    u64 flags = (*entry & ~PAGE_ADDR_MASK & ~PAGE_COW) | PAGE_WRITABLE;
+
+    // Last user of the frame takes it over, forks only add references under this lock
+    if(frame_page(phys)->refcount == 1)
+    {
+        *entry = phys | flags;
+        paging_invalidate(page);
+
+        mutex_unlock(&as->lock);
+        return true;
+    }
+
+    i64 frame = frame_alloc(0);
+
+    if(frame != -1)
+    {
+        memcpy((void*)frame, (void*)phys, PAGE_SIZE);
+        *entry = frame | flags;
+
+        // Other cpus may still read the old frame, which the other sharers might free
+        struct tlb_batch batch;
+        tlb_batch_init(&batch, as);
+        tlb_batch_add(&batch, page, 1);
+        tlb_batch_flush(&batch);
+
+        frame_put(phys);
+    }
+
+    mutex_unlock(&as->lock);
+
+    return frame != -1;
+}
+
+bool region_fault(u64 addr, u64 error, bool intr)
+{
+    struct aspace *as = aspace_current();
+    u64 page = addr & ~PAGE_MASK;
+
+    // Only missing pages and writes to shared pages are served
+    if(error & PF_PRESENT)
+        return (error & PF_WRITE) && region_cow(as, page, error);
+
+    // Interrupts are off in the handler
+    tlb_mutex_lock(&as->lock);
+
+    struct region *region = region_live(as, page);
+    struct region desc;
+
+    bool ret = region != NULL &&
+               (!(error & PF_WRITE) || (region->flags & PAGE_WRITABLE)) &&
+               (!(error & PF_USER) || (region->flags & PAGE_USER));
+
+    if(ret)
+        memcpy(&desc, region, sizeof(struct region));
+
+    mutex_unlock(&as->lock);
+
+    if(!ret)
+        return false;
+
+    // Without the lock, reading a file page may take a while. Other cpus wait
+    // for this one in shootdowns meanwhile, so take interrupts if possible.
+    if(intr)
+        intr_enable();
+
+    i64 frame = region_fill(&desc, page);
+
+    if(intr)
+        intr_disable();
+
+    if(frame == -1)
+        return false;
+
+    tlb_mutex_lock(&as->lock);
+
+    // The region may be gone, or another cpu mapped the page meanwhile
+    region = region_live(as, page);
+    ret = region != NULL && region->start == desc.start;
+
+    bool mapped = false;
+
+    if(ret && paging_walk(as->root, page) == (u64)-1)
+    {
+        mapped = paging_map(as->root, page, frame, desc.flags | PAGE_PRESENT);
+        ret = mapped;
+    }
+
+    mutex_unlock(&as->lock);
+
+    if(!mapped)
+        region_release(&desc, page, frame);
+
+    return ret;
+}
+
+/*
+ * Shares the pages mapped by a table (level 1 to 3) of the parent with the child,
+ * writable frames become read only copy on write in both. Fails on pages no region
+ * accounts for, those would end up writable in both without a reference.
+ */
+static bool region_fork_table(struct aspace *parent, struct paging_cursor *child, struct page_table *table,
+                              u64 level, u64 base, struct tlb_batch *batch)
+{
+    for(u64 i = 0; i < 512; i++)
+    {
+        u64 *entry = (u64*)table + i;
+
+        if(!(*entry & PAGE_PRESENT))
+            continue;
+
+        u64 virt = base + i * PAGE_LEVEL_SIZE(level);
+
+        if(level > 1 && !(*entry & PAGE_HUGE))
+        {
+            if(!region_fork_table(parent, child, (struct page_table*)(*entry & PAGE_ADDR_MASK), level - 1, virt, batch))
+                return false;
+
+            continue;
+        }
+
+        // Regions only map single pages
+        if(level > 1)
+            return false;
+
+        struct region *region = region_find(parent, virt, virt + PAGE_SIZE);
+
+        if(region == NULL)
+            return false;
+
+        if(region->dying)
+            continue;
+
+        u64 phys = *entry & PAGE_ADDR_MASK;
+
+        // Shared file and device pages stay writable in both
+        bool cow = region->type == REGION_ANON || region->type == REGION_FILE;
+
+        if(cow && (*entry & PAGE_WRITABLE))
+        {
+            *entry = (*entry & ~PAGE_WRITABLE) | PAGE_COW;
+            tlb_batch_add(batch, virt, 1);
+        }
+
+        if(!paging_cursor_map(child, virt, phys, *entry & PAGE_FLAGS_MASK, 1))
+            return false;
+
+        region_acquire(region, virt, phys);
+    }
+
+    return true;
+}
+
+bool region_fork(struct aspace *parent, struct aspace *child)
+{
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, parent);
+
+    u64 flags = intr_save();
+    tlb_mutex_lock(&parent->lock);
+
+    bool ret = true;
+
+    // Pages are mapped in address order, so the child's tables are walked once
+    struct paging_cursor cur;
+    paging_cursor_init(&cur, child->root);
+
+    for(struct ktree_node *node = ktree_first(&parent->regions); ret && node != NULL; node = ktree_next(node))
+    {
+        // Pages of dying regions are gone soon, the child gets none of them
+        if((ENCLAVE(struct region, tree_handle, node))->dying)
+            continue;
+
+        struct region *region = kmem_cache_alloc(region_cache);
+
+        if(region == NULL)
+        {
+            ret = false;
+            break;
+        }
+
+        memcpy(region, (ENCLAVE(struct region, tree_handle, node)), sizeof(struct region));
+        ktree_insert(&child->regions, &region->tree_handle, OFFSET(struct region, tree_handle), (int (*)(void*, void*))cmp_regions);
+    }
+
+    // User part only, the rest is shared anyway
+    for(u64 i = ASPACE_USER_START / PAGE_LEVEL_SIZE(4); ret && i < ASPACE_USER_END / PAGE_LEVEL_SIZE(4); i++)
+    {
+        u64 entry = parent->root->entries[i];
+
+        if(entry & PAGE_PRESENT)
+            ret = region_fork_table(parent, &cur, (struct page_table*)(entry & PAGE_ADDR_MASK), 3, i * PAGE_LEVEL_SIZE(4), &batch);
+    }
+
+    // Before unlocking, no cpu may write to a shared frame through a stale entry
+    tlb_batch_flush(&batch);
+
+    mutex_unlock(&parent->lock);
+    intr_restore(flags);
+
+    return ret;
+}
+
+bool region_sync(struct aspace *as, u64 start)
+{
+    u64 offs[TLB_MAX_PAGES];
+
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, as);
+
+    u64 addr = start;
+
+    while(true)
+    {
+        u64 num_dirty = 0;
+
+        u64 flags = intr_save();
+        tlb_mutex_lock(&as->lock);
+
+        struct region *region = region_live(as, start);
+        bool ret = region != NULL && region->start == start && region->type == REGION_SHARED;
+
+        struct region desc;
+        if(ret)
+            memcpy(&desc, region, sizeof(struct region));
+
+        struct paging_cursor cur;
+        paging_cursor_init(&cur, as->root);
+
+        while(ret && num_dirty < TLB_MAX_PAGES && (addr = paging_cursor_next(&cur, addr, desc.end)) < desc.end)
+        {
+            u64 *entry = paging_cursor_leaf(&cur, addr);
+
+            if(entry != NULL && (*entry & PAGE_DIRTY))
+            {
+                // Writes from here on set it again, the extra reference keeps the frame until written
+                __atomic_fetch_and(entry, ~PAGE_DIRTY, __ATOMIC_SEQ_CST);
+                offs[num_dirty] = desc.offset + (addr - desc.start);
+                pcache_get(desc.fs, desc.handle, offs[num_dirty++]);
+
+                tlb_batch_add(&batch, addr, 1);
+            }
+
+            addr += PAGE_SIZE;
+        }
+
+        mutex_unlock(&as->lock);
+        intr_restore(flags);
+
+        if(!ret)
+            return false;
+
+        tlb_batch_flush(&batch);
+
+        for(u64 i = 0; i < num_dirty; i++)
+        {
+            // Failed pages stay dirty for the last put
+            bool written = pcache_flush(desc.fs, desc.handle, offs[i]);
+            pcache_put(desc.fs, desc.handle, offs[i], !written);
+        }
+
+        if(addr >= desc.end)
+            return true;
+    }
+}
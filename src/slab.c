@@ -0,0 +1,347 @@
+#include <vga.h>
+#include <slab.h>
+#include <intr.h>
+#include <percpu.h>
+
+// Slab header follows kmalloc's chunk header at the page start
+#define SLAB_HDR_OFF ((sizeof(struct kchunk) + 7) & ~7ULL)
+
+// List of all caches
+static struct kmem_cache *kmem_caches = NULL;
+static mutex_t kmem_caches_lock = 0;
+
+static struct slab* slab_of(void *obj)
+{
+    return (struct slab*)(((u64)obj & ~PAGE_MASK) + SLAB_HDR_OFF);
+}
+
+static u64 slab_objs_off(struct kmem_cache *cache)
+{
+    return align(SLAB_HDR_OFF + sizeof(struct slab), cache->size & -cache->size);
+}
+
+static void** slab_free_ptr(struct kmem_cache *cache, void *obj)
+{
+    return (void**)((u8*)obj + cache->free_off);
+}
+
+/*
+ * List a slab belongs on, determined by its number of allocated objects
+ */
+static struct slab** slab_list(struct kmem_cache *cache, u64 in_use)
+{
+    if(in_use == 0)
+        return &cache->empty;
+    if(in_use == cache->per_slab)
+        return &cache->full;
+    return &cache->partial;
+}
+
+static void slab_list_add(struct slab **list, struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+
+    if(*list != NULL)
+        (*list)->prev = slab;
+
+    *list = slab;
+}
+
+static void slab_list_remove(struct slab **list, struct slab *slab)
+{
+    if(slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+
+    if(slab->next != NULL)
+        slab->next->prev = slab->prev;
+}
+
+/*
+ * Allocates and constructs a new slab, returns NULL if out of memory
+ */
+static struct slab* slab_create(struct kmem_cache *cache)
+{
+    // Exactly one page including kmalloc's header
+    i64 addr = kmalloc(PAGE_SIZE - sizeof(struct kchunk));
+    if(addr == -1)
+        return NULL;
+
+    u64 page = addr - sizeof(struct kchunk);
+
+    // Heap chunks are page aligned, so this should never happen
+    if((page & PAGE_MASK) != 0)
+    {
+        kfree(addr);
+        return NULL;
+    }
+
+    struct slab *slab = (struct slab*)(page + SLAB_HDR_OFF);
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free = NULL;
+
+    u8 *objs = (u8*)(page + slab_objs_off(cache));
+
+    // Build free list backwards, so objects are handed out in address order
+    for(i64 i = cache->per_slab - 1; i >= 0; i--)
+    {
+        void *obj = objs + i * cache->size;
+
+        if(cache->ctor != NULL)
+            cache->ctor(obj);
+
+        *slab_free_ptr(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    return slab;
+}
+
+static void slab_destroy(struct slab *slab)
+{
+    kfree(((u64)slab & ~PAGE_MASK) + sizeof(struct kchunk));
+}
+
+struct kmem_cache* kmem_cache_create(char *name, u64 size, u64 alignment, void (*ctor)(void*))
+{
+    if(alignment == 0)
+        alignment = 8;
+
+    // Alignment must be a power of two
+    if((alignment & (alignment - 1)) != 0)
+        return NULL;
+
+    i64 addr = kmalloc(sizeof(struct kmem_cache));
+    if(addr == -1)
+        return NULL;
+
+    struct kmem_cache *cache = (struct kmem_cache*)addr;
+    bzero((u8*)cache, sizeof(struct kmem_cache));
+
+    memcpy(cache->name, name, min(strlen(name), SLAB_NAME_LEN - 1));
+
+    cache->obj_size = size;
+    cache->ctor = ctor;
+
+    // Constructed state must survive, so keep the free pointer behind the object
+    if(ctor != NULL)
+    {
+        cache->free_off = align(size, 8);
+        size = cache->free_off + sizeof(void*);
+    }
+    else
+    {
+        cache->free_off = 0;
+        size = max(size, sizeof(void*));
+    }
+
+    cache->size = align(size, max(alignment, 8));
+
+    if(cache->size > SLAB_MAX_OBJ)
+    {
+        kfree(addr);
+        return NULL;
+    }
+
+    cache->per_slab = (PAGE_SIZE - slab_objs_off(cache)) / cache->size;
+
+    mutex_lock(&kmem_caches_lock);
+    cache->next = kmem_caches;
+    kmem_caches = cache;
+    mutex_unlock(&kmem_caches_lock);
+
+    return cache;
+}
+
+/*
+ * Moves up to SLAB_BATCH objects from the slabs to a cpu stack
+ */
+static void kmem_cache_refill(struct kmem_cache *cache, struct kmem_cpu_cache *cpu)
+{
+    mutex_lock(&cache->lock);
+
+    for(i64 i = 0; i < SLAB_BATCH && cpu->count < SLAB_CPU_CACHE; i++)
+    {
+        // Prefer partially used slabs to let empty ones go back to the heap
+        struct slab *slab = cache->partial;
+
+        if(slab == NULL && cache->empty != NULL)
+        {
+            slab = cache->empty;
+            slab_list_remove(&cache->empty, slab);
+            slab_list_add(&cache->partial, slab);
+            cache->num_empty--;
+        }
+
+        if(slab == NULL)
+        {
+            slab = slab_create(cache);
+            if(slab == NULL)
+                break;
+            slab_list_add(&cache->partial, slab);
+
+            cache->num_slabs++;
+            cache->peak_slabs = max(cache->peak_slabs, cache->num_slabs);
+        }
+
+        void *obj = slab->free;
+        slab->free = *slab_free_ptr(cache, obj);
+        slab->in_use++;
+
+        if(slab->in_use == cache->per_slab)
+        {
+            slab_list_remove(&cache->partial, slab);
+            slab_list_add(&cache->full, slab);
+        }
+
+        cpu->objs[cpu->count++] = obj;
+    }
+
+    mutex_unlock(&cache->lock);
+}
+
+/*
+ * Returns count objects from the bottom of a cpu stack to their slabs
+ */
+static void kmem_cache_drain(struct kmem_cache *cache, struct kmem_cpu_cache *cpu, i64 count)
+{
+    mutex_lock(&cache->lock);
+
+    for(i64 i = 0; i < count; i++)
+    {
+        void *obj = cpu->objs[i];
+        struct slab *slab = slab_of(obj);
+
+        slab_list_remove(slab_list(cache, slab->in_use), slab);
+
+        *slab_free_ptr(cache, obj) = slab->free;
+        slab->free = obj;
+        slab->in_use--;
+
+        if(slab->in_use == 0 && cache->num_empty >= SLAB_MAX_EMPTY)
+        {
+            slab_destroy(slab);
+            cache->num_slabs--;
+            continue;
+        }
+
+        slab_list_add(slab_list(cache, slab->in_use), slab);
+
+        if(slab->in_use == 0)
+            cache->num_empty++;
+    }
+
+    mutex_unlock(&cache->lock);
+
+    // Keep the recently freed (cache hot) objects
+    for(i64 i = count; i < cpu->count; i++)
+    {
+        cpu->objs[i - count] = cpu->objs[i];
+    }
+    cpu->count -= count;
+}
+
+void* kmem_cache_alloc(struct kmem_cache *cache)
+{
+    u8 id = this_cpu()->id;
+
+    // Cpu stacks are only shared with interrupt handlers
+    u64 flags = intr_save();
+
+    struct kmem_cpu_cache *cpu = &cache->cpus[id];
+
+    cpu->allocs++;
+
+    if(cpu->count == 0)
+        kmem_cache_refill(cache, cpu);
+
+    void *obj = (cpu->count > 0) ? cpu->objs[--cpu->count] : NULL;
+
+    intr_restore(flags);
+
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    u8 id = this_cpu()->id;
+
+    u64 flags = intr_save();
+
+    struct kmem_cpu_cache *cpu = &cache->cpus[id];
+
+    cpu->frees++;
+
+    if(cpu->count == SLAB_CPU_CACHE)
+        kmem_cache_drain(cache, cpu, SLAB_BATCH);
+
+    cpu->objs[cpu->count++] = obj;
+
+    intr_restore(flags);
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+    mutex_lock(&kmem_caches_lock);
+
+    struct kmem_cache **prev = &kmem_caches;
+    while(*prev != cache && *prev != NULL)
+    {
+        prev = &(*prev)->next;
+    }
+    if(*prev == cache)
+        *prev = cache->next;
+
+    mutex_unlock(&kmem_caches_lock);
+
+    u64 flags = intr_save();
+
+    for(i64 i = 0; i < MAX_CPUS; i++)
+    {
+        kmem_cache_drain(cache, &cache->cpus[i], cache->cpus[i].count);
+    }
+
+    intr_restore(flags);
+
+    // Objects still in use are lost with their slabs
+    struct slab *lists[3] = {cache->empty, cache->partial, cache->full};
+
+    for(i64 i = 0; i < 3; i++)
+    {
+        struct slab *slab = lists[i];
+
+        while(slab != NULL)
+        {
+            struct slab *next = slab->next;
+            slab_destroy(slab);
+            slab = next;
+        }
+    }
+
+    kfree((i64)cache);
+}
+
+void kmem_cache_dump_stats()
+{
+    mutex_lock(&kmem_caches_lock);
+
+    for(struct kmem_cache *cache = kmem_caches; cache != NULL; cache = cache->next)
+    {
+        u64 allocs = 0;
+        u64 frees = 0;
+
+        for(u64 i = 0; i < MAX_CPUS; i++)
+        {
+            allocs += cache->cpus[i].allocs;
+            frees += cache->cpus[i].frees;
+        }
+
+        kprintf("Cache %s: size %u, slabs %u (peak %u), allocs %u, frees %u\n",
+                cache->name, cache->obj_size, cache->num_slabs, cache->peak_slabs, allocs, frees);
+    }
+
+    mutex_unlock(&kmem_caches_lock);
+}
@@ -2,11 +2,8 @@
 #include <vga.h>
 #include <syscalls.h>
 
-extern void kernel_stack;
 extern void syscall_handler();
 
-static struct kernel_root kernel_root_struct;
-
 void syscalls_setup()
 {
     // Disable interrupts but leave rest as it is
@@ -15,11 +12,7 @@ void syscalls_setup()
     // Set handler address
     wmsr(MSR_IA32_LSTAR, (u64)syscall_handler);
 
-    // Init kernel root struct
-    kernel_root_struct.kernel_stack = (u64)&kernel_stack;
-
-    // Set stack for syscall handler
-    wmsr(MSR_IA32_KERNEL_GS_BASE, (u64)&kernel_root_struct);
+    // The stack for the handler comes from the cpu's kernel_root (see percpu.h)
 
     // Set segment selectors in STAR register
     // NOTE: The manual specifies that certains offsets are added to selector values
@@ -0,0 +1,211 @@
+#include <io.h>
+#include <tlb.h>
+#include <intr.h>
+#include <percpu.h>
+
+// Cpus with interrupts set up
+static u64 tlb_online = 0;
+
+// One shootdown at a time
+static mutex_t tlb_lock = 0;
+static struct tlb_batch *tlb_request = NULL;
+static u64 tlb_pending = 0;     // Cpus which still have to flush tlb_request
+
+void tlb_cpu_init()
+{
+    __atomic_fetch_or(&tlb_online, 1ULL << this_cpu()->id, __ATOMIC_SEQ_CST);
+}
+
+void tlb_batch_init(struct tlb_batch *batch, struct aspace *as)
+{
+    batch->as = as;
+    batch->num_ranges = 0;
+    batch->pages = 0;
+    batch->full = false;
+}
+
+void tlb_batch_add(struct tlb_batch *batch, u64 addr, u64 pages)
+{
+    addr &= ~PAGE_MASK;
+    batch->pages += pages;
+
+    if(batch->full || batch->pages > TLB_MAX_PAGES)
+    {
+        batch->full = true;
+        return;
+    }
+
+    // Merge with a range it touches
+    for(u64 i = 0; i < batch->num_ranges; i++)
+    {
+        struct tlb_range *range = &batch->ranges[i];
+
+        u64 end = addr + pages * PAGE_SIZE;
+        u64 range_end = range->start + range->pages * PAGE_SIZE;
+
+        if(addr <= range_end && range->start <= end)
+        {
+            range->start = min(range->start, addr);
+            range->pages = (max(range_end, end) - range->start) / PAGE_SIZE;
+            return;
+        }
+    }
+
+    if(batch->num_ranges == TLB_MAX_RANGES)
+    {
+        batch->full = true;
+        return;
+    }
+
+    batch->ranges[batch->num_ranges].start = addr;
+    batch->ranges[batch->num_ranges].pages = pages;
+    batch->num_ranges++;
+}
+
+/*
+ * Flush all entries of all PCIDs, including global ones
+ */
+static void tlb_flush_all()
+{
+    u64 cr4 = rcr4();
+    wcr4(cr4 ^ CR4_PGE);
+    wcr4(cr4);
+}
+
+/*
+ * Flush all non global entries of the current PCID
+ */
+static void tlb_flush_current()
+{
+    u64 cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r" (cr3));
+    __asm__ volatile("mov %0, %%cr3" : : "r" (cr3 & ~CR3_NO_FLUSH) : "memory");
+}
+
+/*
+ * Executes a batch on this cpu
+ */
+static void tlb_flush_local(struct tlb_batch *batch)
+{
+    u8 cpu = this_cpu()->id;
+
+    if(batch->as == aspace_kernel())
+    {
+        // Kernel mappings are global, invlpg drops global entries under every PCID
+        if(batch->full)
+        {
+            tlb_flush_all();
+            return;
+        }
+    }
+    else if(aspace_current() != batch->as)
+    {
+        // Switched away meanwhile, flush when switching back
+        __atomic_fetch_and(&batch->as->tlb_cpus, ~(1ULL << cpu), __ATOMIC_SEQ_CST);
+        return;
+    }
+    else if(batch->full)
+    {
+        tlb_flush_current();
+        return;
+    }
+
+    for(u64 i = 0; i < batch->num_ranges; i++)
+    {
+        for(u64 j = 0; j < batch->ranges[i].pages; j++)
+        {
+            paging_invalidate(batch->ranges[i].start + j * PAGE_SIZE);
+        }
+    }
+}
+
+/*
+ * Serve a request for this cpu if there is one
+ */
+static void tlb_poll()
+{
+    u64 bit = 1ULL << this_cpu()->id;
+
+    if(__atomic_load_n(&tlb_pending, __ATOMIC_SEQ_CST) & bit)
+    {
+        tlb_flush_local(tlb_request);
+        __atomic_fetch_and(&tlb_pending, ~bit, __ATOMIC_SEQ_CST);
+    }
+}
+
+void tlb_handle_intr()
+{
+    tlb_poll();
+}
+
+void tlb_mutex_lock(mutex_t *lock)
+{
+    while(atomic_tas(lock))
+    {
+        tlb_poll();
+    }
+}
+
+void tlb_batch_flush(struct tlb_batch *batch)
+{
+    if(batch->num_ranges == 0 && !batch->full)
+        return;
+
+    u64 flags = intr_save();
+
+    u8 cpu = this_cpu()->id;
+    u64 self = 1ULL << cpu;
+
+    u64 targets;
+
+    if(batch->as == aspace_kernel())
+    {
+        targets = tlb_online;
+    }
+    else
+    {
+        // Lazy: cpus without the address space active flush on their next switch.
+        // Clearing before reading active_cpus catches cpus switching concurrently.
+        u64 keep = (aspace_current() == batch->as) ? self : 0;
+        __atomic_fetch_and(&batch->as->tlb_cpus, keep, __ATOMIC_SEQ_CST);
+
+        targets = __atomic_load_n(&batch->as->active_cpus, __ATOMIC_SEQ_CST) & tlb_online;
+    }
+
+    if(aspace_current() == batch->as || batch->as == aspace_kernel())
+        tlb_flush_local(batch);
+
+    targets &= ~self;
+
+    if(targets != 0)
+    {
+        // Serve requests of other cpus while waiting, they may wait for us
+        while(atomic_tas(&tlb_lock))
+        {
+            tlb_poll();
+        }
+
+        tlb_request = batch;
+        __atomic_store_n(&tlb_pending, targets, __ATOMIC_SEQ_CST);
+
+        lapic_t lapic = lapic_fetch();
+
+        for(u64 i = 0; i < MAX_CPUS; i++)
+        {
+            if(targets & (1ULL << i))
+                lapic_ipi_fixed(lapic, i, INTR_NUM_TLB);
+        }
+
+        while(__atomic_load_n(&tlb_pending, __ATOMIC_SEQ_CST) != 0)
+        {
+            __asm__ volatile("pause");
+        }
+
+        tlb_request = NULL;
+        mutex_unlock(&tlb_lock);
+    }
+
+    intr_restore(flags);
+
+    tlb_batch_init(batch, batch->as);
+}
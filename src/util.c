@@ -2,21 +2,21 @@
 
 void bzero(u8 *mem, u64 size)
 {
-    for(u64 i = 0; i < size; i++)
-    {
-        mem[i] = 0;
-    }
+    // Quad words first, then the remaining bytes (direction flag is clear per ABI)
+    u64 quads = size / 8;
+    u64 bytes = size % 8;
+
+    __asm__ volatile("rep stosq" : "+D" (mem), "+c" (quads) : "a" (0ULL) : "memory");
+    __asm__ volatile("rep stosb" : "+D" (mem), "+c" (bytes) : "a" (0ULL) : "memory");
 }
 
 void memcpy(void *dst, void *src, size_t sz)
 {
-    u8* bdst = (u8*)dst;
-    u8* bsrc = (u8*)src;
+    u64 quads = sz / 8;
+    u64 bytes = sz % 8;
 
-    for(size_t i = 0; i < sz; i++)
-    {
-        bdst[i] = bsrc[i];
-    }
+    __asm__ volatile("rep movsq" : "+D" (dst), "+S" (src), "+c" (quads) : : "memory");
+    __asm__ volatile("rep movsb" : "+D" (dst), "+S" (src), "+c" (bytes) : : "memory");
 }
 
 bool memcmp(u8 *m0, u8 *m1, size_t n)
@@ -63,327 +63,326 @@ i64 abs(i64 x)
     return x;
 }
 
-struct ktree_node* ktree_leftmost(struct ktree_node *root)
+static struct ktree_node* ktree_leftmost(struct ktree_node *node)
 {
-    struct ktree_node *curr = root;
-
-    while(1)
+    while(node->left != NULL)
     {
-        if(curr->valid[KTREE_LEFT])
-        {
-            curr = curr->left;
-        }
-        else
-        {
-            return curr;
-        }
+        node = node->left;
     }
+    return node;
 }
 
-struct ktree_node* ktree_rightmost(struct ktree_node *root)
+static bool ktree_red(struct ktree_node *node)
 {
-    struct ktree_node *curr = root;
+    // Leafs (NULL) are black
+    return node != NULL && node->red;
+}
 
-    while(1)
-    {
-        if(curr->valid[KTREE_RIGHT])
-        {
-            curr = curr->right;
-        }
-        else
-        {
-            return curr;
-        }
-    }
+/*
+ * Puts new_node at the place of old_node in old_node's parent
+ */
+static void ktree_replace(struct ktree *root, struct ktree_node *old_node, struct ktree_node *new_node)
+{
+    if(old_node->parent == NULL)
+        root->root = new_node;
+    else if(old_node->parent->left == old_node)
+        old_node->parent->left = new_node;
+    else
+        old_node->parent->right = new_node;
+
+    if(new_node != NULL)
+        new_node->parent = old_node->parent;
+}
+
+static void ktree_rotate_left(struct ktree *root, struct ktree_node *node)
+{
+    struct ktree_node *r = node->right;
+
+    node->right = r->left;
+    if(r->left != NULL)
+        r->left->parent = node;
+
+    ktree_replace(root, node, r);
+
+    r->left = node;
+    node->parent = r;
+}
+
+static void ktree_rotate_right(struct ktree *root, struct ktree_node *node)
+{
+    struct ktree_node *l = node->left;
+
+    node->left = l->right;
+    if(l->right != NULL)
+        l->right->parent = node;
+
+    ktree_replace(root, node, l);
+
+    l->right = node;
+    node->parent = l;
 }
 
 bool ktree_empty(struct ktree *root)
 {
-    return !root->valid;
+    return root->root == NULL;
 }
 
-void __ktree_insert(struct ktree_node *root, struct ktree_node *node, 
+void ktree_insert(struct ktree *root, struct ktree_node *node, 
                   int off, int (*cmp)(void*, void*))
 {
-    while(1)
+    struct ktree_node *parent = NULL;
+    struct ktree_node **link = &root->root;
+
+    void *nv = ((u8*)node) - off;
+
+    // Plain bst insertion
+    while(*link != NULL)
     {
-        void *rv = ((u8*)root) - off;
-        void *nv = ((u8*)node) - off;
+        parent = *link;
 
-        int r = cmp(rv, nv);
+        void *pv = ((u8*)parent) - off;
 
-        if(r < 0)
-        {
-            if(root->valid[KTREE_LEFT])
-            {
-                root = root->left;
-            }
-            else 
-            {
-                root->valid[KTREE_LEFT] = true;
-                root->left = node;
-                node->parent = root;
-                return;
-            }
-        }
+        if(cmp(nv, pv) < 0)
+            link = &parent->left;
         else
-        {
-            if(root->valid[KTREE_RIGHT])
-            {
-                root = root->right;
-            }
-            else
-            {
-                root->valid[KTREE_RIGHT] = true;
-                root->right = node;
-                node->parent = root;
-                return;
-            }
-        }
+            link = &parent->right;
     }
-}
 
-void __ktree_remove(struct ktree_node *root, struct ktree_node *node, 
-                  int off, int (*cmp)(void*, void*))
-{
-    while(1) 
-    {
-        void *rv = ((u8*)root) - off;
-        void *nv = ((u8*)node) - off;
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = parent;
+    node->red = true;
+    *link = node;
 
-        int r = cmp(rv, nv);
+    // Restore red black properties (no red node has a red child)
+    while(ktree_red(node->parent))
+    {
+        parent = node->parent;
+        struct ktree_node *gparent = parent->parent;
 
-        if(r == 0)
+        if(parent == gparent->left)
         {
-            // Delete node
+            struct ktree_node *uncle = gparent->right;
 
-            // No children
-            if(!root->valid[KTREE_LEFT] && !root->valid[KTREE_RIGHT])
+            if(ktree_red(uncle))
             {
-                if(root->parent->left == root)
-                {
-                    root->parent->valid[KTREE_LEFT] = false;
-                }
-                else 
-                {
-                    root->parent->valid[KTREE_RIGHT] = false;
-                }
+                // Recolor and continue above
+                parent->red = false;
+                uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
             }
 
-            // Only one child
-            if(!root->valid[KTREE_LEFT] && root->valid[KTREE_RIGHT])
+            if(node == parent->right)
             {
-                if(root->parent->left == root)
-                {
-                    root->parent->left = root->right;
-                }
-                else 
-                {
-                    root->parent->right = root->right;
-                }
-            }
-            if(root->valid[KTREE_LEFT] && !root->valid[KTREE_RIGHT])
-            {
-                if(root->parent->left == root)
-                {
-                    root->parent->left = root->left;
-                }
-                else 
-                {
-                    root->parent->right = root->left;
-                }
+                ktree_rotate_left(root, parent);
+                node = parent;
+                parent = node->parent;
             }
 
-            // Two children
-            if(root->valid[KTREE_LEFT] && root->valid[KTREE_RIGHT])
-            {
-                struct ktree_node *tr = root->right;
-                if(root->parent->left == root)
-                {
-                    root->parent->left = root->left;
-                }
-                else
-                {
-                    root->parent->right = root->left;
-                }
-                struct ktree_node *rm = ktree_rightmost(root->left);
-                rm->right = tr;
-                rm->valid[KTREE_RIGHT] = true;
-                rm->parent = root->parent;
-                tr->parent = rm;
-            }
-
-            return;
-        }
-        // Continue traversing
-        else if(r < 0)
-        {
-            if(root->valid[KTREE_LEFT])
-            {
-                root = root->left;
-            }
-            else 
-            {
-                return;
-            }
+            parent->red = false;
+            gparent->red = true;
+            ktree_rotate_right(root, gparent);
         }
-        else 
+        else
         {
-            if(root->valid[KTREE_RIGHT])
+            struct ktree_node *uncle = gparent->left;
+
+            if(ktree_red(uncle))
             {
-                root = root->right;
+                parent->red = false;
+                uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
             }
-            else 
+
+            if(node == parent->left)
             {
-                return;
+                ktree_rotate_right(root, parent);
+                node = parent;
+                parent = node->parent;
             }
+
+            parent->red = false;
+            gparent->red = true;
+            ktree_rotate_left(root, gparent);
         }
     }
+
+    root->root->red = false;
 }
 
-void ktree_insert(struct ktree *root, struct ktree_node *node, 
-                  int off, int (*cmp)(void*, void*))
+void ktree_remove(struct ktree *root, struct ktree_node *node)
 {
-    if(root->valid)
+    struct ktree_node *child;       // Node moving up into the removed position
+    struct ktree_node *parent;      // Parent of child (child may be NULL)
+    bool removed_red;
+
+    if(node->left == NULL || node->right == NULL)
     {
-        __ktree_insert(root->root, node, off, cmp);
+        child = (node->left != NULL) ? node->left : node->right;
+        parent = node->parent;
+        removed_red = node->red;
+
+        ktree_replace(root, node, child);
     }
     else
     {
-        root->valid = true;
-        root->root = node;
-    }
-}
-
-void ktree_remove(struct ktree *root, struct ktree_node *node, 
-                  int off, int (*cmp)(void*, void*))
-{
-    if(root->valid)
-    {
-        void *rv = ((u8*)root->root) - off;
-        void *nv = ((u8*)node) - off;
+        // Two children, successor takes the place of node
+        struct ktree_node *succ = ktree_leftmost(node->right);
 
-        int r = cmp(rv, nv);
+        child = succ->right;
+        removed_red = succ->red;
 
-        if(r == 0)
+        if(succ->parent == node)
         {
-            // Delete node
-
-            // No children
-            if(!root->root->valid[KTREE_LEFT] && !root->root->valid[KTREE_RIGHT])
-            {
-                root->valid = false;
-            }
-
-            // Only one child
-            if(!root->root->valid[KTREE_LEFT] && root->root->valid[KTREE_RIGHT])
-            {
-                root->root = root->root->right;
-            }
-            if(root->root->valid[KTREE_LEFT] && !root->root->valid[KTREE_RIGHT])
-            {
-                root->root = root->root->left;
-            }
-
-            // Two children
-            if(root->root->valid[KTREE_LEFT] && root->root->valid[KTREE_RIGHT])
-            {
-                struct ktree_node *tr = root->root->right;
-                root->root = root->root->left;
-                struct ktree_node *rm = ktree_rightmost(root->root);
-                rm->right = tr;
-                rm->valid[KTREE_RIGHT] = true;
-                tr->parent = rm;
-            }
-        }
-        else if(r < 0)
-        {
-            __ktree_remove(root->root->left, node, off, cmp);
+            parent = succ;
         }
         else
         {
-            __ktree_remove(root->root->right, node, off, cmp);
+            parent = succ->parent;
+
+            ktree_replace(root, succ, child);
+            succ->right = node->right;
+            succ->right->parent = succ;
         }
+
+        ktree_replace(root, node, succ);
+        succ->left = node->left;
+        succ->left->parent = succ;
+        succ->red = node->red;
     }
-}
 
-bool ktree_contains(struct ktree *root, void *val, int off, int (*cmp)(void*, void*))
-{
-    struct ktree_node *curr = root->root;
+    if(removed_red)
+        return;
 
-    while(true)
+    // A black node is gone, restore equal black heights
+    while(child != root->root && !ktree_red(child))
     {
-        void *cv = ((u8*)curr) - off;
+        if(child == parent->left)
+        {
+            struct ktree_node *sibling = parent->right;
 
-        int r = cmp(cv, val);
+            if(ktree_red(sibling))
+            {
+                sibling->red = false;
+                parent->red = true;
+                ktree_rotate_left(root, parent);
+                sibling = parent->right;
+            }
 
-        if(r == 0)
-        {
-            return true;
-        }
-        else if(r < 0)
-        {
-            if(curr->valid[KTREE_LEFT])
+            if(!ktree_red(sibling->left) && !ktree_red(sibling->right))
             {
-                curr = curr->left;
+                sibling->red = true;
+                child = parent;
+                parent = child->parent;
+                continue;
             }
-            else
+
+            if(!ktree_red(sibling->right))
             {
-                return false;
+                sibling->left->red = false;
+                sibling->red = true;
+                ktree_rotate_right(root, sibling);
+                sibling = parent->right;
             }
+
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            ktree_rotate_left(root, parent);
+            child = root->root;
         }
         else
         {
-            if(curr->valid[KTREE_RIGHT])
+            struct ktree_node *sibling = parent->left;
+
+            if(ktree_red(sibling))
             {
-                curr = curr->right;
+                sibling->red = false;
+                parent->red = true;
+                ktree_rotate_right(root, parent);
+                sibling = parent->left;
             }
-            else
+
+            if(!ktree_red(sibling->left) && !ktree_red(sibling->right))
+            {
+                sibling->red = true;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+
+            if(!ktree_red(sibling->left))
             {
-                return false;
+                sibling->right->red = false;
+                sibling->red = true;
+                ktree_rotate_left(root, sibling);
+                sibling = parent->left;
             }
+
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            ktree_rotate_right(root, parent);
+            child = root->root;
         }
     }
+
+    if(child != NULL)
+        child->red = false;
+}
+
+bool ktree_contains(struct ktree *root, void *val, int off, int (*cmp)(void*, void*))
+{
+    struct ktree_node *res;
+    return ktree_find(root, val, off, cmp, &res);
 }
 
 bool ktree_find(struct ktree *root, void *val, int off, int (*cmp)(void*, void*), struct ktree_node **res)
 {
     struct ktree_node *curr = root->root;
 
-    while(true)
+    while(curr != NULL)
     {
         void *cv = ((u8*)curr) - off;
 
-        int r = cmp(cv, val);
+        int r = cmp(val, cv);
 
         if(r == 0)
         {
             *res = curr;
             return true;
         }
-        else if(r < 0)
-        {
-            if(curr->valid[KTREE_LEFT])
-            {
-                curr = curr->left;
-            }
-            else
-            {
-                return false;
-            }
-        }
-        else
-        {
-            if(curr->valid[KTREE_RIGHT])
-            {
-                curr = curr->right;
-            }
-            else
-            {
-                return false;
-            }
-        }
+
+        curr = (r < 0) ? curr->left : curr->right;
     }
+
+    return false;
+}
+
+struct ktree_node* ktree_first(struct ktree *root)
+{
+    if(root->root == NULL)
+        return NULL;
+
+    return ktree_leftmost(root->root);
+}
+
+struct ktree_node* ktree_next(struct ktree_node *node)
+{
+    if(node->right != NULL)
+        return ktree_leftmost(node->right);
+
+    // Go up until we come from a left subtree
+    while(node->parent != NULL && node == node->parent->right)
+    {
+        node = node->parent;
+    }
+
+    return node->parent;
 }
 
 bool klist_empty(struct klist *root)
@@ -1,4 +1,5 @@
 #include <virtio.h>
+#include <frame.h>
 
 #define BARRIER asm("mfence");
 
@@ -38,16 +39,18 @@ bool virtio_create_queue(virtio_dev_t *virtio_dev, u16 queue_num)
     // Size for total virtq (NOTE: device can have multiple virtqs)
     u16 queue_size = virtq_size(queue_elems);
 
-    // Allocate memory
-    virtio_dev->virtqs[queue_num].space = kmalloc(queue_size);
+    // Smallest block of frames holding the queue
+    u64 order = 0;
+    while((FRAME_SIZE << order) < queue_size)
+        order++;
+
+    // Allocate zeroed, page aligned memory
+    virtio_dev->virtqs[queue_num].space = frame_zalloc(order);
 
     // Check error
     if(virtio_dev->virtqs[queue_num].space == -1)
         return false;
 
-    // Zero memory
-    bzero((u8*)virtio_dev->virtqs[queue_num].space, queue_size);
-
     // Write aligned address back to queue_address 
     outd(iobase + VIRTIO_HEADER_QUEUE_ADDRESS, align((u64)virtio_dev->virtqs[queue_num].space, 4096) / 4096);
 
@@ -61,6 +64,33 @@ bool virtio_create_queue(virtio_dev_t *virtio_dev, u16 queue_num)
     return true;
 }
 
+/*
+ * Accept all features the driver supports and the device offers.
+ * Must be called before DRIVER_OK is set.
+ *
+ * @return Negotiated features
+ */
+u32 virtio_negotiate(virtio_dev_t *virtio_dev, u32 driver_features)
+{
+    // Get virtio device's io offset
+    u32 iobase = pci_bar(virtio_dev->pci_dev, 0);
+
+    // Check error
+    if(iobase == 0xFFFFFFFF)
+        return 0;
+
+    // Get only address from bar
+    iobase &= 0xFFFFFFFC;
+
+    // Intersect offered and supported features
+    u32 features = ind(iobase + VIRTIO_HEADER_DEVICE_FEATURES) & driver_features;
+
+    // Tell device what we use
+    outd(iobase + VIRTIO_HEADER_GUEST_FEATURES, features);
+
+    return features;
+}
+
 bool virtio_dev_init(virtio_dev_t *virtio_dev, pci_dev_t *pci_dev, u16 num_queues)
 {
     // Save for later
@@ -90,7 +120,7 @@ bool virtio_dev_deinit(virtio_dev_t *virtio_dev)
     // Free all virtqs
     for(u16 i = 0; i < virtio_dev->num_queues; i++)
     {
-        kfree(virtio_dev->virtqs[i].space);
+        frame_free(virtio_dev->virtqs[i].space);
     }
 
     // Free virtq pointer array
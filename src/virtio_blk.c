@@ -1,10 +1,34 @@
 #include <virtio_blk.h>
 
+// Features this driver knows how to use
+#define VIRTIO_BLK_DRIVER_FEATURES (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | \
+                                    VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_TOPOLOGY | \
+                                    VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_CONFIG_WCE | \
+                                    VIRTIO_BLK_F_WRITE_ZEROES)
+
+// Source for zeroing when device can't do it on its own
+static u8 __attribute__((aligned(4096))) zero_page[4096];
+
+// Small device visible objects, shared by all block devices
+static struct kmem_cache *virtio_block_req_cache = NULL;
+static struct kmem_cache *virtio_block_range_cache = NULL;
+
 bool virtio_block_dev_init(virtio_blk_dev_t *blk_dev, virtio_dev_t *virtio_dev)
 {
     // Save for later
     blk_dev->virtio_dev = virtio_dev;
 
+    if(virtio_block_req_cache == NULL)
+    {
+        virtio_block_req_cache = kmem_cache_create("virtio_blk_req", 
+                                                   sizeof(struct virtio_block_req), 16, NULL);
+        virtio_block_range_cache = kmem_cache_create("virtio_blk_range", 
+                                                     sizeof(struct virtio_block_discard_write_zeroes), 16, NULL);
+    }
+
+    if(virtio_block_req_cache == NULL || virtio_block_range_cache == NULL)
+        return false;
+
     // Get virtio device's io offset
     u32 iobase = pci_bar(virtio_dev->pci_dev, 0);
 
@@ -15,8 +39,11 @@ bool virtio_block_dev_init(virtio_blk_dev_t *blk_dev, virtio_dev_t *virtio_dev)
     // Get only address from bar
     iobase &= 0xFFFFFFFC;
 
+    // Device specific config
+    u32 cfg = iobase + VIRTIO_HEADER_DEVICE_OFFSET;
+
     // Read size of disk
-    blk_dev->size = (((u64)ind(iobase + 0x18)) << 32) | ((u64)ind(iobase + 0x14));
+    blk_dev->size = (((u64)ind(cfg + VIRTIO_BLK_CFG_CAPACITY + 4)) << 32) | ((u64)ind(cfg + VIRTIO_BLK_CFG_CAPACITY));
    
     // Reset device
     virtio_dev_reset(virtio_dev);
@@ -24,11 +51,65 @@ bool virtio_block_dev_init(virtio_blk_dev_t *blk_dev, virtio_dev_t *virtio_dev)
     // Unlock device
     outb(iobase + VIRTIO_HEADER_DEVICE_STATUS, 3);
 
+    // Negotiate features before the device goes live
+    blk_dev->features = virtio_negotiate(virtio_dev, VIRTIO_BLK_DRIVER_FEATURES);
+
+    // Run with write back cache if we are able to flush it
+    blk_dev->writeback = (blk_dev->features & VIRTIO_BLK_F_FLUSH) != 0;
+
+    if(blk_dev->features & VIRTIO_BLK_F_CONFIG_WCE)
+    {
+        outb(cfg + VIRTIO_BLK_CFG_WRITEBACK, blk_dev->writeback);
+    }
+
+    // Disk geometry, defaults to plain 512 byte sectors
+    blk_dev->blk_size = VIRTIO_BLK_SECTOR_SIZE;
+    blk_dev->phys_blk_size = VIRTIO_BLK_SECTOR_SIZE;
+    blk_dev->align_offset = 0;
+    blk_dev->min_io_size = VIRTIO_BLK_SECTOR_SIZE;
+    blk_dev->opt_io_size = 0;
+
+    if(blk_dev->features & VIRTIO_BLK_F_BLK_SIZE)
+    {
+        blk_dev->blk_size = ind(cfg + VIRTIO_BLK_CFG_BLK_SIZE);
+        blk_dev->phys_blk_size = blk_dev->blk_size;
+        blk_dev->min_io_size = blk_dev->blk_size;
+    }
+
+    if(blk_dev->features & VIRTIO_BLK_F_TOPOLOGY)
+    {
+        // Topology fields are given in logical blocks
+        u32 lbs = blk_dev->blk_size;
+        blk_dev->phys_blk_size = lbs << inb(cfg + VIRTIO_BLK_CFG_PHYS_BLOCK_EXP);
+        blk_dev->align_offset = (inb(cfg + VIRTIO_BLK_CFG_ALIGNMENT_OFFSET) * lbs) / VIRTIO_BLK_SECTOR_SIZE;
+        blk_dev->min_io_size = max(lbs, inw(cfg + VIRTIO_BLK_CFG_MIN_IO_SIZE) * lbs);
+        blk_dev->opt_io_size = ind(cfg + VIRTIO_BLK_CFG_OPT_IO_SIZE) * lbs;
+    }
+
+    // Request size limit (0 means no limit was given)
+    blk_dev->max_write_zeroes_sectors = 0;
+
+    if(blk_dev->features & VIRTIO_BLK_F_WRITE_ZEROES)
+    {
+        blk_dev->max_write_zeroes_sectors = ind(cfg + VIRTIO_BLK_CFG_MAX_WRITE_ZEROES_SECTORS);
+    }
+
     // Create virtqueue
     virtio_create_queue(virtio_dev, 0);
 
-    // Currently no advanced features
-    outd(iobase + VIRTIO_HEADER_GUEST_FEATURES, 0);
+    // Segment limits, a request also needs descriptors for header and status
+    blk_dev->seg_max = min(VIRTIO_BLK_MAX_SEGS, virtio_dev->virtqs[0].elems - 2);
+    blk_dev->size_max = 0;
+
+    if(blk_dev->features & VIRTIO_BLK_F_SEG_MAX)
+    {
+        blk_dev->seg_max = max(1, min(blk_dev->seg_max, ind(cfg + VIRTIO_BLK_CFG_SEG_MAX)));
+    }
+
+    if(blk_dev->features & VIRTIO_BLK_F_SIZE_MAX)
+    {
+        blk_dev->size_max = ind(cfg + VIRTIO_BLK_CFG_SIZE_MAX);
+    }
 
     // Device ready
     outb(iobase + VIRTIO_HEADER_DEVICE_STATUS, 7);
@@ -36,83 +117,124 @@ bool virtio_block_dev_init(virtio_blk_dev_t *blk_dev, virtio_dev_t *virtio_dev)
     return true;
 }
 
-bool virtio_block_dev_write(virtio_blk_dev_t *blk_dev, u64 sector, u8 *data, u64 num_sectors)
+/**
+ * Submits one request and waits for its completion
+ *
+ * @param type Request type (VIRTIO_BLK_T_xxx)
+ * @param segs Data buffers (may be NULL if num_segs is 0)
+ * @param num_segs Number of data buffers (at most VIRTIO_BLK_MAX_SEGS)
+ * @param data_flags Descriptor flags of data buffers
+ *
+ * @return Status byte written by the device or 0xff on submission error
+ */
+static u8 virtio_block_dev_request(virtio_blk_dev_t *blk_dev, u32 type, u64 sector, 
+                                   struct virtio_block_seg *segs, u16 num_segs, u16 data_flags)
 {
-    // Submit write to device
-    struct virtio_block_req_hdr *blkhdr = (struct virtio_block_req_hdr*)align(kmalloc(4096), 4096);
-    blkhdr->type = VIRTIO_BLK_T_OUT;
-    blkhdr->ioprio = 0;
-    blkhdr->sector = sector;
+    if(num_segs > VIRTIO_BLK_MAX_SEGS)
+        return 0xff;
 
-    u8 *status = (u8*)align(kmalloc(4096), 4096);
+    struct virtio_block_req *req = (struct virtio_block_req*)kmem_cache_alloc(virtio_block_req_cache);
+    if(req == NULL)
+        return 0xff;
+
+    req->hdr.type = type;
+    req->hdr.ioprio = 0;
+    req->hdr.sector = sector;
+
+    volatile u8 *status = &req->status;
     *status = 0xff;
 
-    struct virtq_desc desc_arr[3];
+    struct virtq_desc desc_arr[VIRTIO_BLK_MAX_SEGS + 2];
+    u16 num_desc = 0;
 
-    desc_arr[0].addr = (u64)blkhdr;
-    desc_arr[0].len = 16;
-    desc_arr[0].flags = 0;
+    desc_arr[num_desc].addr = (u64)&req->hdr;
+    desc_arr[num_desc].len = sizeof(struct virtio_block_req_hdr);
+    desc_arr[num_desc].flags = 0;
+    num_desc++;
 
-    desc_arr[1].addr = (u64)data;
-    desc_arr[1].len = 512 * num_sectors;
-    desc_arr[1].flags = 0;
+    for(u16 i = 0; i < num_segs; i++)
+    {
+        desc_arr[num_desc].addr = (u64)segs[i].data;
+        desc_arr[num_desc].len = segs[i].len;
+        desc_arr[num_desc].flags = data_flags;
+        num_desc++;
+    }
 
-    desc_arr[2].addr = (u64)status;
-    desc_arr[2].len = 1;
-    desc_arr[2].flags = VRING_DESC_F_WRITE;
+    desc_arr[num_desc].addr = (u64)status;
+    desc_arr[num_desc].len = 1;
+    desc_arr[num_desc].flags = VRING_DESC_F_WRITE;
+    num_desc++;
 
-    bool ret = virtio_deploy(blk_dev->virtio_dev, 0, desc_arr, 3);
-    if(!ret)
-        return false;
+    u8 ret = 0xff;
 
-    // Wait for completion
-    while(*status == 0xff);
+    if(virtio_deploy(blk_dev->virtio_dev, 0, desc_arr, num_desc))
+    {
+        // Wait for completion
+        while(*status == 0xff);
 
-    // IOError code is due to conflicting sector sizes of guest and host (see https://bugzilla.redhat.com/show_bug.cgi?id=1738839)
+        ret = *status;
+    }
 
     // Free resources
-    kfree((i64)blkhdr);
-    kfree((i64)status);
+    kmem_cache_free(virtio_block_req_cache, req);
 
-    return true;
+    return ret;
 }
 
-bool virtio_block_dev_read(virtio_blk_dev_t *blk_dev, u64 sector, u8 *data, u64 num_sectors)
+/*
+ * Checks that a sector range covers whole logical blocks.
+ * Other requests are answered with IOERR by the host 
+ * (see https://bugzilla.redhat.com/show_bug.cgi?id=1738839)
+ */
+static bool virtio_block_dev_aligned(virtio_blk_dev_t *blk_dev, u64 sector, u64 num_sectors)
 {
-    struct virtio_block_req_hdr *blkhdr = (struct virtio_block_req_hdr*)align(kmalloc(4096), 4096);
-    blkhdr->type = VIRTIO_BLK_T_IN;
-    blkhdr->ioprio = 0;
-    blkhdr->sector = sector;
+    return ((sector * VIRTIO_BLK_SECTOR_SIZE) % blk_dev->blk_size) == 0 &&
+           ((num_sectors * VIRTIO_BLK_SECTOR_SIZE) % blk_dev->blk_size) == 0;
+}
 
-    u8 *status = (u8*)align(kmalloc(4096), 4096);
-    *status = 0xff;
+bool virtio_block_dev_write(virtio_blk_dev_t *blk_dev, u64 sector, u8 *data, u64 num_sectors)
+{
+    if(!virtio_block_dev_aligned(blk_dev, sector, num_sectors))
+        return false;
+
+    struct virtio_block_seg seg = {.data = data, .len = VIRTIO_BLK_SECTOR_SIZE * num_sectors};
+
+    // Submit write to device
+    u8 status = virtio_block_dev_request(blk_dev, VIRTIO_BLK_T_OUT, sector, &seg, 1, 0);
+
+    return status == VIRTIO_BLK_S_OK;
+}
 
-    struct virtq_desc desc_arr[3];
+bool virtio_block_dev_read(virtio_blk_dev_t *blk_dev, u64 sector, u8 *data, u64 num_sectors)
+{
+    if(!virtio_block_dev_aligned(blk_dev, sector, num_sectors))
+        return false;
 
-    desc_arr[0].addr = (u64)blkhdr;
-    desc_arr[0].len = 16;
-    desc_arr[0].flags = 0;
+    struct virtio_block_seg seg = {.data = data, .len = VIRTIO_BLK_SECTOR_SIZE * num_sectors};
 
-    desc_arr[1].addr = (u64)data;
-    desc_arr[1].len = 512 * num_sectors;
-    desc_arr[1].flags = VRING_DESC_F_WRITE;
+    u8 status = virtio_block_dev_request(blk_dev, VIRTIO_BLK_T_IN, sector, &seg, 1, VRING_DESC_F_WRITE);
 
-    desc_arr[2].addr = (u64)status;
-    desc_arr[2].len = 1;
-    desc_arr[2].flags = VRING_DESC_F_WRITE;
+    return status == VIRTIO_BLK_S_OK;
+}
 
-    bool ret = virtio_deploy(blk_dev->virtio_dev, 0, desc_arr, 3);
-    if(!ret)
+/* Gathers multiple buffers into one write request */
+bool virtio_block_dev_writev(virtio_blk_dev_t *blk_dev, u64 sector, struct virtio_block_seg *segs, u16 num_segs)
+{
+    if(num_segs > blk_dev->seg_max)
         return false;
 
-    // Wait for completion
-    while(*status == 0xff);
+    u64 num_sectors = 0;
+    for(u16 i = 0; i < num_segs; i++)
+    {
+        num_sectors += segs[i].len / VIRTIO_BLK_SECTOR_SIZE;
+    }
 
-    // Free resources
-    kfree((i64)blkhdr);
-    kfree((i64)status);
+    if(!virtio_block_dev_aligned(blk_dev, sector, num_sectors))
+        return false;
 
-    return true;
+    u8 status = virtio_block_dev_request(blk_dev, VIRTIO_BLK_T_OUT, sector, segs, num_segs, 0);
+
+    return status == VIRTIO_BLK_S_OK;
 }
 
 /* Write one block */
@@ -127,9 +249,87 @@ inline bool virtio_block_dev_read_block(virtio_blk_dev_t *blk_dev, u64 sector, u
     return virtio_block_dev_read(blk_dev, sector, data, 1);
 }
 
+/**
+ * Issues discard or write zeroes requests for a sector range,
+ * split according to the device's max request size
+ */
+static bool virtio_block_dev_range(virtio_blk_dev_t *blk_dev, u32 type, u64 sector, 
+                                   u64 num_sectors, u32 max_sectors, u32 flags)
+{
+    struct virtio_block_discard_write_zeroes *seg = 
+        (struct virtio_block_discard_write_zeroes*)kmem_cache_alloc(virtio_block_range_cache);
+
+    if(seg == NULL)
+        return false;
+
+    // No limit given
+    if(max_sectors == 0)
+        max_sectors = 0xFFFFFFFF;
+
+    bool ret = true;
+
+    while(num_sectors > 0)
+    {
+        u64 count = min(num_sectors, max_sectors);
+
+        seg->sector = sector;
+        seg->num_sectors = count;
+        seg->flags = flags;
+
+        struct virtio_block_seg payload = {.data = (u8*)seg, .len = sizeof(struct virtio_block_discard_write_zeroes)};
+
+        if(virtio_block_dev_request(blk_dev, type, 0, &payload, 1, 0) != VIRTIO_BLK_S_OK)
+        {
+            ret = false;
+            break;
+        }
+
+        sector += count;
+        num_sectors -= count;
+    }
+
+    kmem_cache_free(virtio_block_range_cache, seg);
+
+    return ret;
+}
+
+/* Zeros out sector range */
+bool virtio_block_dev_write_zeroes(virtio_blk_dev_t *blk_dev, u64 sector, u64 num_sectors, bool unmap)
+{
+    if(blk_dev->features & VIRTIO_BLK_F_WRITE_ZEROES)
+    {
+        return virtio_block_dev_range(blk_dev, VIRTIO_BLK_T_WRITE_ZEROES, sector, num_sectors, 
+                                      blk_dev->max_write_zeroes_sectors, 
+                                      unmap ? VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0);
+    }
+
+    // Fallback: transfer zeros (one page at a time)
+    while(num_sectors > 0)
+    {
+        u64 count = min(num_sectors, sizeof(zero_page) / VIRTIO_BLK_SECTOR_SIZE);
+
+        if(!virtio_block_dev_write(blk_dev, sector, zero_page, count))
+            return false;
+
+        sector += count;
+        num_sectors -= count;
+    }
+
+    return true;
+}
+
 /* Zeros out one block */
 bool virtio_block_dev_zero(virtio_blk_dev_t *blk_dev, u64 sector)
 {
-    unsigned char data[512] = {0};
-    return virtio_block_dev_write(blk_dev, sector, data, 1);
-}
\ No newline at end of file
+    return virtio_block_dev_write_zeroes(blk_dev, sector, 1, false);
+}
+
+/* Writes back the device's volatile cache */
+bool virtio_block_dev_flush(virtio_blk_dev_t *blk_dev)
+{
+    // Write through device, completed writes are already durable
+    if(!blk_dev->writeback)
+        return true;
+
+    return virtio_block_dev_request(blk_dev, VIRTIO_BLK_T_FLUSH, 0, NULL, 0, 0) == VIRTIO_BLK_S_OK;
+}
@@ -0,0 +1,214 @@
+#include <vmalloc.h>
+#include <frame.h>
+#include <intr.h>
+#include <slab.h>
+#include <tlb.h>
+
+// Areas sorted by address
+static struct ktree vmalloc_areas = {NULL};
+static mutex_t vmalloc_lock = 0;
+
+static struct kmem_cache *vm_area_cache = NULL;
+
+static int cmp_areas(struct vm_area *a0, struct vm_area *a1)
+{
+    if(a0->addr < a1->addr)
+        return -1;
+    if(a0->addr == a1->addr)
+        return 0;
+    return 1;
+}
+
+bool vmalloc_init()
+{
+    vm_area_cache = kmem_cache_create("vm_area", sizeof(struct vm_area), 0, NULL);
+    if(vm_area_cache == NULL)
+        return false;
+
+    // Replace the identity mapping of this slot with an empty directory pointer table
+    i64 table = frame_zalloc(0);
+    if(table == -1)
+        return false;
+
+    page_id_ptr.entries[VMALLOC_SLOT] = table | PAGE_PRESENT | PAGE_WRITABLE;
+
+    // Flush old translations of the slot
+    paging_activate(&page_id_ptr);
+
+    return true;
+}
+
+/*
+ * First fit search for pages plus guard between the areas, returns -1 if the range is full
+ */
+static i64 vmalloc_find(u64 pages)
+{
+    u64 need = pages * PAGE_SIZE + VMALLOC_GUARD;
+
+    // Leading guard of the first area
+    u64 addr = VMALLOC_START + VMALLOC_GUARD;
+
+    for(struct ktree_node *node = ktree_first(&vmalloc_areas); node != NULL; node = ktree_next(node))
+    {
+        struct vm_area *area = (ENCLAVE(struct vm_area, tree_handle, node));
+
+        if(addr + need <= area->addr)
+            break;
+
+        // Behind this area's guard, which doubles as leading guard
+        addr = area->addr + area->pages * PAGE_SIZE + VMALLOC_GUARD;
+    }
+
+    if(addr + need > VMALLOC_END)
+        return -1;
+
+    return addr;
+}
+
+/*
+ * Unmaps pages of an area and frees their frames, takes the lock itself.
+ * The range stays reserved in the tree until the TLBs are flushed. The
+ * shootdown runs without the lock, cpus spinning on it can't take IPIs.
+ */
+static void vmalloc_unmap(u64 addr, u64 pages)
+{
+    u64 frames[TLB_MAX_PAGES];
+
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, aspace_kernel());
+
+    for(u64 done = 0; done < pages;)
+    {
+        u64 chunk = min(pages - done, TLB_MAX_PAGES);
+        u64 num_frames = 0;
+
+        u64 flags = intr_save();
+        mutex_lock(&vmalloc_lock);
+
+        struct paging_cursor cur;
+        paging_cursor_init(&cur, &page_id_ptr);
+
+        for(u64 i = 0; i < chunk; i++)
+        {
+            u64 entry = paging_cursor_unmap(&cur, addr + (done + i) * PAGE_SIZE);
+
+            if(entry != 0)
+                frames[num_frames++] = entry & PAGE_ADDR_MASK;
+        }
+
+        mutex_unlock(&vmalloc_lock);
+        intr_restore(flags);
+
+        // Frames may only be reused once no cpu can reach them anymore
+        tlb_batch_add(&batch, addr + done * PAGE_SIZE, chunk);
+        tlb_batch_flush(&batch);
+
+        for(u64 i = 0; i < num_frames; i++)
+        {
+            frame_free(frames[i]);
+        }
+
+        done += chunk;
+    }
+}
+
+static void vmalloc_remove(struct vm_area *area)
+{
+    u64 flags = intr_save();
+    mutex_lock(&vmalloc_lock);
+    ktree_remove(&vmalloc_areas, &area->tree_handle);
+    mutex_unlock(&vmalloc_lock);
+    intr_restore(flags);
+}
+
+i64 vmalloc(i64 size)
+{
+    if(size <= 0 || vm_area_cache == NULL)
+        return -1;
+
+    struct vm_area *area = kmem_cache_alloc(vm_area_cache);
+    if(area == NULL)
+        return -1;
+
+    area->pages = align(size, PAGE_SIZE) / PAGE_SIZE;
+
+    // Page tables of the range are shared, so mapping happens under the lock too
+    u64 flags = intr_save();
+    mutex_lock(&vmalloc_lock);
+
+    i64 addr = vmalloc_find(area->pages);
+
+    if(addr == -1)
+    {
+        mutex_unlock(&vmalloc_lock);
+        intr_restore(flags);
+        kmem_cache_free(vm_area_cache, area);
+        return -1;
+    }
+
+    // Reserve the range right away, undoing a failure happens without the lock
+    area->addr = addr;
+    ktree_insert(&vmalloc_areas, &area->tree_handle, OFFSET(struct vm_area, tree_handle), (int (*)(void*, void*))cmp_areas);
+
+    // Consecutive pages share their upper tables
+    struct paging_cursor cur;
+    paging_cursor_init(&cur, &page_id_ptr);
+
+    u64 mapped = 0;
+
+    while(mapped < area->pages)
+    {
+        i64 frame = frame_alloc(0);
+        if(frame == -1)
+            break;
+
+        if(!paging_cursor_map(&cur, addr + mapped * PAGE_SIZE, frame, PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL | paging_no_exec(), 1))
+        {
+            frame_free(frame);
+            break;
+        }
+
+        mapped++;
+    }
+
+    mutex_unlock(&vmalloc_lock);
+    intr_restore(flags);
+
+    if(mapped != area->pages)
+    {
+        // Out of memory, undo everything
+        vmalloc_unmap(addr, mapped);
+        vmalloc_remove(area);
+        kmem_cache_free(vm_area_cache, area);
+        return -1;
+    }
+
+    return addr;
+}
+
+i64 vfree(i64 addr)
+{
+    struct vm_area query = {.addr = addr};
+    struct ktree_node *node = NULL;
+
+    u64 flags = intr_save();
+    mutex_lock(&vmalloc_lock);
+
+    bool found = ktree_find(&vmalloc_areas, &query, OFFSET(struct vm_area, tree_handle), (int (*)(void*, void*))cmp_areas, &node);
+
+    mutex_unlock(&vmalloc_lock);
+    intr_restore(flags);
+
+    if(!found)
+        return -1;
+
+    struct vm_area *area = (ENCLAVE(struct vm_area, tree_handle, node));
+
+    // Flushes the TLBs of all cpus before the frames and the range are reused
+    vmalloc_unmap(area->addr, area->pages);
+    vmalloc_remove(area);
+
+    kmem_cache_free(vm_area_cache, area);
+
+    return 0;
+}
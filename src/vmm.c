@@ -1,58 +1,159 @@
+#include <io.h>
 #include <vmm.h>
+#include <tlb.h>
+#include <frame.h>
 
 // ***********************************************************
 // * These functions are used to create the identity mapping *
 // ***********************************************************
 
-extern struct page_table page_id_ptr;
-extern struct page_table page_id_dir[512];
-extern struct page_table page_id_tab[512 * 512];
-
-void paging_id_fill_table(struct page_table *table, u64 frame_offset)
+void paging_id_fill_table(struct page_table *table, u64 frame_offset, u64 flags)
 {
     u64 curr_offset = frame_offset;
     for(int i = 0; i < 512; i++)
     {
-        table->entries[i] = curr_offset | 0b10000011; // 2MiB pages
+        table->entries[i] = curr_offset | flags | PAGE_HUGE; // 2MiB pages
         curr_offset += 0x200000;
     }
 }
 
-void paging_id_fill_directory(struct page_table *directory, u64 frame_offset)
+bool paging_huge_1g()
 {
-    u64 curr_offset = frame_offset;
-    for(int i = 0; i < 512; i++)
+    u32 regs[4];
+
+    // Highest extended leaf
+    cpuid(0x80000000, 0, regs);
+    if(regs[0] < 0x80000001)
+        return false;
+
+    // PDPE1GB
+    cpuid(0x80000001, 0, regs);
+    return (regs[3] & (1 << 26)) != 0;
+}
+
+bool paging_nx()
+{
+    u32 regs[4];
+
+    cpuid(0x80000000, 0, regs);
+    if(regs[0] < 0x80000001)
+        return false;
+
+    // NX
+    cpuid(0x80000001, 0, regs);
+    return (regs[3] & (1 << 20)) != 0;
+}
+
+static u64 paging_nx_flag = 0;
+
+void paging_cpu_init()
+{
+    if(paging_nx())
     {
-        directory->entries[i] = curr_offset | 0b011;
-        curr_offset += sizeof(struct page_table);
+        wmsr(MSR_EFER, rmsr(MSR_EFER) | EFER_NXE);
+        paging_nx_flag = PAGE_NO_EXEC;
     }
+
+    wcr4(rcr4() | CR4_PGE);
+
+    // Copy on write pages fault on kernel writes as well
+    wcr0(rcr0() | CR0_WP);
 }
 
-// Full mapping of virtual address space
-void paging_id_full()
+u64 paging_no_exec()
 {
-    paging_id_fill_directory(&page_id_ptr, (u64)&page_id_dir);
+    return paging_nx_flag;
+}
 
-    for(u64 i = 0; i < 512; i++)
+u64 paging_id_tables(u64 end)
+{
+    end = min(align(end, 0x40000000), PAGE_ID_LIMIT);
+
+    if(paging_huge_1g() || end <= PAGE_ID_BOOT_END)
+        return 0;
+
+    return (end - PAGE_ID_BOOT_END) / 0x40000000;
+}
+
+// Map all of ram, replaces the boot time mapping where possible
+void paging_id_full(u64 end, struct page_table *tables)
+{
+    end = min(align(max(end, PAGE_ID_BOOT_END), 0x40000000), PAGE_ID_LIMIT);
+
+    bool huge = paging_huge_1g();
+
+    for(u64 i = 0; i < end / 0x40000000; i++)
     {
-        paging_id_fill_directory(&page_id_dir[i], (u64)&page_id_tab[i * 512]);
+        // The kernel runs from the first GiB, paging_protect_kernel restricts it
+        u64 flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL | ((i > 0) ? paging_no_exec() : 0);
+
+        if(huge)
+        {
+            // 1GiB pages
+            page_id_dir[0].entries[i] = (i * 0x40000000) | flags | PAGE_HUGE;
+        }
+        else
+        {
+            // Boot tables cover the first GiBs already, same translations with the new flags
+            struct page_table *table = (i < PAGE_ID_NUM_TABS) ? &page_id_tab[i] : tables++;
+
+            paging_id_fill_table(table, i * 0x40000000, flags);
+            page_id_dir[0].entries[i] = (u64)table | PAGE_PRESENT | PAGE_WRITABLE;
+        }
     }
 
-    for(u64 i = 0; i < 512 * 512; i++)
+    // Flush old translations
+    paging_activate(&page_id_ptr);
+}
+
+extern char kernel_smp_start[];
+extern char kernel_smp_end[];
+extern char kernel_text_start[];
+extern char kernel_text_end[];
+extern char kernel_rodata_start[];
+extern char kernel_rodata_end[];
+
+bool paging_protect_kernel()
+{
+    u64 nx = paging_no_exec();
+
+    u64 rw = PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL | nx;
+    u64 ro = PAGE_PRESENT | PAGE_GLOBAL | nx;
+    u64 rx = PAGE_PRESENT | PAGE_GLOBAL;
+
+    // Section boundaries are page aligned, gaps and what follows the image are data
+    struct
+    {
+        u64 start;
+        u64 end;
+        u64 flags;
+    } parts[] =
     {
-        paging_id_fill_table(&page_id_tab[i], i * 0x40000000);
+        {0,                            (u64)kernel_smp_start,     rw},
+        {(u64)kernel_smp_start,        (u64)kernel_smp_end,       rx},     // AP trampoline, runs in place
+        {(u64)kernel_smp_end,          (u64)kernel_text_start,    rw},
+        {(u64)kernel_text_start,       (u64)kernel_text_end,      rx},
+        {(u64)kernel_text_end,         (u64)kernel_rodata_start,  rw},
+        {(u64)kernel_rodata_start,     (u64)kernel_rodata_end,    ro},
+        {(u64)kernel_rodata_end,       0x40000000,                rw},
+    };
+
+    for(u64 i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+    {
+        if(!paging_map_range(&page_id_ptr, parts[i].start, parts[i].start, parts[i].flags,
+                             parts[i].end - parts[i].start, PAGE_LEVEL_SIZE(2)))
+            return false;
     }
+
+    return true;
 }
 
 // ******************************************************************
-// * These functions are for general purpose (4k) paging operations *
+// * These functions are for general purpose paging operations      *
 // ******************************************************************
 
-// Get level indeces
-#define PAGE_L1(x) ((x >> 12) & 0x1FF)
-#define PAGE_L2(x) ((x >> 21) & 0x1FF)
-#define PAGE_L3(x) ((x >> 30) & 0x1FF)
-#define PAGE_L4(x) ((x >> 39) & 0x1FF)
+// Flags of entries pointing to tables, leaves restrict access
+#define PAGE_TABLE_FLAGS (PAGE_PRESENT | PAGE_WRITABLE)
 
 void paging_activate(struct page_table *table)
 {
@@ -60,107 +161,303 @@ void paging_activate(struct page_table *table)
     __asm__ volatile("mov %0,%%cr3" : : "r" (table) : "memory");
 }
 
-// Allocate one page table and insert into parent
-static void alloc_entry(struct page_table *table, u64 index, u16 flags)
+/*
+ * Replaces the huge page entry (level 3 or 2) with a table of the next smaller pages
+ */
+static bool paging_split(u64 *entry, u64 level, u64 virt_addr)
 {
-    u64 addr = align(kmalloc(4096), 4096);
-    bzero((u8*)addr, 4096);
-    table->entries[index] = addr | flags;
+    i64 addr = frame_alloc(0);
+    if(addr == -1)
+        return false;
+
+    struct page_table *table = (struct page_table*)addr;
+
+    u64 phys = *entry & PAGE_ADDR_MASK & ~(PAGE_LEVEL_SIZE(level) - 1);
+    u64 flags = *entry & ~PAGE_ADDR_MASK;
+
+    // Only 2MiB pages carry the huge flag further down
+    if(level == 2)
+        flags &= ~PAGE_HUGE;
+
+    for(u64 i = 0; i < 512; i++)
+    {
+        table->entries[i] = (phys + i * PAGE_LEVEL_SIZE(level - 1)) | flags;
+    }
+
+    *entry = addr | PAGE_TABLE_FLAGS | (flags & PAGE_USER);
+
+    // Same translations, but the page size changed
+    paging_invalidate(virt_addr);
+
+    return true;
 }
 
-void paging_map(struct page_table *p4, u64 virt_addr, u64 phys_addr, u16 flags)
+void paging_free_table(struct page_table *table, u64 level)
 {
-    // Entry of p4
-    u64 pe4 = p4->entries[PAGE_L4(virt_addr)];
+    for(u64 i = 0; level > 1 && i < 512; i++)
+    {
+        u64 entry = table->entries[i];
+
+        if((entry & PAGE_PRESENT) && !(entry & PAGE_HUGE))
+            paging_free_table((struct page_table*)(entry & PAGE_ADDR_MASK), level - 1);
+    }
 
-    // Allocate new page directory
-    if(!(pe4 & PAGE_PRESENT))
+    // Boot time tables aren't managed by the frame allocator and stay
+    frame_free((u64)table);
+}
+
+void paging_cursor_init(struct paging_cursor *cur, struct page_table *p4)
+{
+    for(u64 l = 0; l < 4; l++)
     {
-        alloc_entry(p4, PAGE_L4(virt_addr), flags);
+        cur->tables[l] = NULL;
+        cur->links[l] = NULL;
+        cur->tags[l] = 0;
     }
 
-    // P3 Table
-    struct page_table *p3 = (struct page_table*)(p4->entries[PAGE_L4(virt_addr)] & (~4095));
+    cur->tables[4] = p4;
+}
 
-    // P3 Entry
-    u64 pe3 = p3->entries[PAGE_L3(virt_addr)];
-    if(!(pe3 & PAGE_PRESENT))
+/*
+ * Makes cur->tables[level] the table of virt_addr, starting at the lowest remembered table which still covers it.
+ * Missing tables are allocated if alloc is set, huge pages on the way are split if split is set.
+ * Returns level, or the level of the table where it had to stop.
+ */
+static u64 paging_cursor_walk(struct paging_cursor *cur, u64 virt_addr, u64 level, u64 flags, bool alloc, bool split)
+{
+    // If a table covers the address, so do all above it
+    u64 l = level;
+    while(l < 4 && (cur->tables[l] == NULL || cur->tags[l] != virt_addr / PAGE_LEVEL_SIZE(l + 1)))
+        l++;
+
+    // User pages need user accessible tables, also on the remembered part of the path
+    if(flags & PAGE_USER)
     {
-        alloc_entry(p3, PAGE_L3(virt_addr), flags);
+        for(u64 i = l; i < 4; i++)
+        {
+            *cur->links[i] |= PAGE_USER;
+        }
     }
 
-    // P2 Table
-    struct page_table *p2 = (struct page_table*)(p3->entries[PAGE_L3(virt_addr)] & (~4095));
+    // Tables below are of another range now, remembered ones always form a path from the top
+    for(u64 i = 1; i < l; i++)
+    {
+        cur->tables[i] = NULL;
+    }
 
-    // P2 Entry
-    u64 pe2 = p2->entries[PAGE_L2(virt_addr)];
-    if(!(pe2 & PAGE_PRESENT))
+    for(; l > level; l--)
     {
-        alloc_entry(p2, PAGE_L2(virt_addr), flags);
+        u64 *entry = (u64*)cur->tables[l] + PAGE_INDEX(l, virt_addr);
+
+        if(!(*entry & PAGE_PRESENT))
+        {
+            if(!alloc)
+                return l;
+
+            // Allocate one (zeroed) page table and insert into parent
+            i64 addr = frame_zalloc(0);
+            if(addr == -1)
+                return l;
+
+            *entry = addr | PAGE_TABLE_FLAGS;
+        }
+        else if(l <= 3 && (*entry & PAGE_HUGE))
+        {
+            if(!split || !paging_split(entry, l, virt_addr))
+                return l;
+        }
+
+        *entry |= flags & PAGE_USER;
+
+        cur->tables[l - 1] = (struct page_table*)(*entry & PAGE_ADDR_MASK);
+        cur->tags[l - 1] = virt_addr / PAGE_LEVEL_SIZE(l);
+        cur->links[l - 1] = entry;
     }
 
-    // P1 Table
-    struct page_table *p1 = (struct page_table*)(p2->entries[PAGE_L2(virt_addr)] & (~4095));
+    return level;
+}
+
+/*
+ * Entry of virt_addr in level, splits huge pages on the way
+ * Missing tables are allocated if alloc is set, otherwise NULL is returned
+ */
+static u64* paging_entry(struct page_table *p4, u64 virt_addr, u64 level, u64 flags, bool alloc)
+{
+    struct paging_cursor cur;
+    paging_cursor_init(&cur, p4);
+
+    if(paging_cursor_walk(&cur, virt_addr, level, flags, alloc, true) != level)
+        return NULL;
 
-    // Write phys addr into P1 Table
-    p1->entries[PAGE_L1(virt_addr)] = phys_addr | flags;
+    return (u64*)cur.tables[level] + PAGE_INDEX(level, virt_addr);
 }
 
-void paging_map_range(struct page_table *p4, u64 virt_addr, u64 phys_addr, u16 flags, u64 size, u64 page_size)
+bool paging_cursor_map(struct paging_cursor *cur, u64 virt_addr, u64 phys_addr, u64 flags, u64 level)
 {
-    for(u64 i = 0; i < size / page_size; i++)
+    if(paging_cursor_walk(cur, virt_addr, level, flags, true, true) != level)
+        return false;
+
+    u64 *entry = (u64*)cur->tables[level] + PAGE_INDEX(level, virt_addr);
+    u64 old = *entry;
+
+    *entry = phys_addr | flags | ((level > 1) ? PAGE_HUGE : 0);
+
+    // A huge page replaces the whole table below
+    if(level > 1 && (old & PAGE_PRESENT) && !(old & PAGE_HUGE))
+    {
+        // Any cpu may cache translations and walks through the table, they must be gone before it is freed.
+        // The table can belong to any address space, a full kernel batch reaches every cpu and PCID.
+        struct tlb_batch batch;
+        tlb_batch_init(&batch, aspace_kernel());
+        batch.full = true;
+        tlb_batch_flush(&batch);
+
+        paging_free_table((struct page_table*)(old & PAGE_ADDR_MASK), level - 1);
+
+        for(u64 l = 1; l < level; l++)
+        {
+            cur->tables[l] = NULL;
+        }
+    }
+    else if(old & PAGE_PRESENT)
     {
-        paging_map(p4, virt_addr + i * page_size, phys_addr + i * page_size, flags);
+        paging_invalidate(virt_addr);
     }
+
+    return true;
 }
 
-// Virtual to physical address
-u64 paging_walk(struct page_table *p4, u64 virt_addr)
+u64* paging_cursor_leaf(struct paging_cursor *cur, u64 virt_addr)
 {
-    // Entry of p4
-    u64 pe4 = p4->entries[PAGE_L4(virt_addr)];
+    if(paging_cursor_walk(cur, virt_addr, 1, 0, false, true) != 1)
+        return NULL;
 
-    // Allocate new page directory
-    if(!(pe4 & PAGE_PRESENT))
+    return (u64*)cur->tables[1] + PAGE_INDEX(1, virt_addr);
+}
+
+u64 paging_cursor_unmap(struct paging_cursor *cur, u64 virt_addr)
+{
+    u64 *entry = paging_cursor_leaf(cur, virt_addr);
+
+    if(entry == NULL || !(*entry & PAGE_PRESENT))
+        return 0;
+
+    // Cpus writing through cached entries may set the dirty bit until it is cleared
+    return __atomic_exchange_n(entry, 0, __ATOMIC_SEQ_CST);
+}
+
+u64 paging_cursor_next(struct paging_cursor *cur, u64 virt_addr, u64 end)
+{
+    while(virt_addr < end)
     {
-        // Error (not mapped)
-        return -1;
+        u64 l = paging_cursor_walk(cur, virt_addr, 1, 0, false, false);
+
+        // 4k or huge page
+        if(cur->tables[l]->entries[PAGE_INDEX(l, virt_addr)] & PAGE_PRESENT)
+            return virt_addr;
+
+        // Nothing mapped in the range of the missing entry
+        virt_addr = (virt_addr & ~(PAGE_LEVEL_SIZE(l) - 1)) + PAGE_LEVEL_SIZE(l);
     }
 
-    // P3 Table
-    struct page_table *p3 = (struct page_table*)(pe4 & (~4095));
+    return end;
+}
+
+bool paging_map(struct page_table *p4, u64 virt_addr, u64 phys_addr, u64 flags)
+{
+    struct paging_cursor cur;
+    paging_cursor_init(&cur, p4);
+
+    return paging_cursor_map(&cur, virt_addr, phys_addr, flags, 1);
+}
+
+bool paging_map_range(struct page_table *p4, u64 virt_addr, u64 phys_addr, u64 flags, u64 size, u64 page_size)
+{
+    // 1GiB pages need cpu support
+    u64 max_level = 1;
+    if(page_size >= PAGE_LEVEL_SIZE(3) && paging_huge_1g())
+        max_level = 3;
+    else if(page_size >= PAGE_LEVEL_SIZE(2))
+        max_level = 2;
+
+    // Consecutive pages share their upper tables
+    struct paging_cursor cur;
+    paging_cursor_init(&cur, p4);
 
-    // P3 Entry
-    u64 pe3 = p3->entries[PAGE_L3(virt_addr)];
-    if(!(pe3 & PAGE_PRESENT))
+    u64 offset = 0;
+
+    while(offset + PAGE_SIZE <= size)
     {
-        // Error (not mapped)
-        return -1;
+        u64 virt = virt_addr + offset;
+        u64 phys = phys_addr + offset;
+
+        // Biggest page both addresses are aligned to and which fits into the rest
+        u64 level = max_level;
+        while(level > 1 && (((virt | phys) & (PAGE_LEVEL_SIZE(level) - 1)) != 0 ||
+                            offset + PAGE_LEVEL_SIZE(level) > size))
+        {
+            level--;
+        }
+
+        if(!paging_cursor_map(&cur, virt, phys, flags, level))
+            return false;
+
+        offset += PAGE_LEVEL_SIZE(level);
     }
 
-    // P2 Table
-    struct page_table *p2 = (struct page_table*)(pe3 & (~4095));
+    return true;
+}
+
+// Virtual to physical address
+u64 paging_walk(struct page_table *p4, u64 virt_addr)
+{
+    struct page_table *table = p4;
 
-    // P2 Entry
-    u64 pe2 = p2->entries[PAGE_L2(virt_addr)];
-    if(!(pe2 & PAGE_PRESENT))
+    for(u64 l = 4; l >= 1; l--)
     {
-        // Error (not mapped)
-        return -1;
+        u64 entry = table->entries[PAGE_INDEX(l, virt_addr)];
+
+        if(!(entry & PAGE_PRESENT))
+        {
+            // Error (not mapped)
+            return -1;
+        }
+
+        // Leaf, get physical address (without flags)
+        if(l == 1 || (l <= 3 && (entry & PAGE_HUGE)))
+        {
+            u64 mask = PAGE_LEVEL_SIZE(l) - 1;
+            return (entry & PAGE_ADDR_MASK & ~mask) | (virt_addr & mask);
+        }
+
+        table = (struct page_table*)(entry & PAGE_ADDR_MASK);
     }
 
-    // P1 Table
-    struct page_table *p1 = (struct page_table*)(pe2 & (~4095));
+    return -1;
+}
+
+u64* paging_leaf(struct page_table *p4, u64 virt_addr)
+{
+    return paging_entry(p4, virt_addr, 1, 0, false);
+}
 
-    // P1 Entry
-    u64 pe1 = p1->entries[PAGE_L1(virt_addr)];
+u64 paging_unmap(struct page_table *p4, u64 virt_addr)
+{
+    // Huge pages are split, so only this page goes away
+    u64 *entry = paging_entry(p4, virt_addr, 1, 0, false);
 
-    if(!(pe1 & PAGE_PRESENT))
-    {
-        // Error (not mapped)
+    if(entry == NULL || !(*entry & PAGE_PRESENT))
         return -1;
-    }
 
-    // Get physical address (without flags)
-    return (pe1 & (~4095)) | (virt_addr & 4095);
-}
\ No newline at end of file
+    u64 old = *entry;
+
+    *entry = 0;
+    paging_invalidate(virt_addr);
+
+    return old & PAGE_ADDR_MASK;
+}
+
+void paging_invalidate(u64 virt_addr)
+{
+    __asm__ volatile("invlpg (%0)" : : "r" (virt_addr) : "memory");
+}